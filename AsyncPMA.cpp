@@ -0,0 +1,136 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include "defines.hpp"
+#include "AsyncPMA.hpp"
+
+using namespace std;
+
+AsyncPMA::AsyncPMA(PMA<> *pma) : pma(pma){
+    dispatcher = thread(&AsyncPMA::dispatch, this);
+}
+
+/*
+    Runs what is still queued, then stops the dispatcher
+ */
+AsyncPMA::~AsyncPMA(){
+    {
+        lock_guard<mutex> guard(queueLock);
+        stopping = true;
+    }
+    queued.notify_one();
+    dispatcher.join();
+}
+
+future<optional<type_t>> AsyncPMA::submit_get(type_t key){
+    operation o = {OpGet, key, 0, promise<optional<type_t>>()};
+    future<optional<type_t>> f = std::get<0>(o.reply).get_future();
+    enqueue(std::move(o));
+    return f;
+}
+
+//Inserts key or overwrites its value. The future tells whether key was inserted
+future<bool> AsyncPMA::submit_put(type_t key, type_t value){
+    operation o = {OpPut, key, value, promise<bool>()};
+    future<bool> f = std::get<1>(o.reply).get_future();
+    enqueue(std::move(o));
+    return f;
+}
+
+future<bool> AsyncPMA::submit_remove(type_t key){
+    operation o = {OpRemove, key, 0, promise<bool>()};
+    future<bool> f = std::get<1>(o.reply).get_future();
+    enqueue(std::move(o));
+    return f;
+}
+
+future<tuple<type_t, type_t>> AsyncPMA::submit_range_sum(type_t startKey, type_t endKey){
+    operation o = {OpRangeSum, startKey, endKey, promise<tuple<type_t, type_t>>()};
+    future<tuple<type_t, type_t>> f = std::get<2>(o.reply).get_future();
+    enqueue(std::move(o));
+    return f;
+}
+
+void AsyncPMA::enqueue(operation &&o){
+    bool wake;
+    {
+        lock_guard<mutex> guard(queueLock);
+        wake = pending.empty();
+        pending.push_back(std::move(o));
+    }
+    if(wake) queued.notify_one();
+}
+
+/*
+    Dispatcher loop. The PMA is only touched from here while the front end runs
+ */
+void AsyncPMA::dispatch(){
+    vector<operation> batch;
+    while(true){
+        {
+            unique_lock<mutex> lock(queueLock);
+            queued.wait(lock, [this]{ return !pending.empty() || stopping; });
+            if(pending.empty()) return;
+            batch.swap(pending);
+        }
+        runBatch(batch);
+        batches++;
+        operations += batch.size();
+        batch.clear();
+    }
+}
+
+/*
+    Splits the batch at its range sums, so each range sum sees exactly the operations submitted before it
+ */
+void AsyncPMA::runBatch(vector<operation> &batch){
+    vector<operation *> point;
+    for(u_int i = 0; i<batch.size(); i++){
+        if(batch[i].op != OpRangeSum){
+            point.push_back(&batch[i]);
+            continue;
+        }
+        runPoint(point);
+        point.clear();
+        std::get<2>(batch[i].reply).set_value(pma->range_sum(batch[i].key, batch[i].value));
+    }
+    runPoint(point);
+}
+
+/*
+    Point operations in key order (stable, so one key keeps its submission order). Each run of gets
+    goes through lookup_batch and each run of puts and removes through write_batch
+ */
+void AsyncPMA::runPoint(vector<operation *> &point){
+    stable_sort(point.begin(), point.end(), [](const operation *a, const operation *b){ return a->key < b->key; });
+
+    vector<type_t> keys, values;
+    unique_ptr<bool[]> removes(new bool[point.size() + 1]), results(new bool[point.size() + 1]);
+    size_t i = 0;
+    while(i < point.size()){
+        size_t j = i;
+        keys.clear();
+        values.clear();
+        if(point[i]->op == OpGet){
+            while(j < point.size() && point[j]->op == OpGet) keys.push_back(point[j++]->key);
+            values.resize(keys.size());
+            pma->lookup_batch(keys.data(), keys.size(), values.data(), results.get());
+            for(size_t k = i; k<j; k++){
+                if(results[k - i]) std::get<0>(point[k]->reply).set_value(values[k - i]);
+                else std::get<0>(point[k]->reply).set_value(nullopt);
+            }
+        }
+        else{
+            for(; j < point.size() && point[j]->op != OpGet; j++){
+                removes[j - i] = point[j]->op == OpRemove;
+                keys.push_back(point[j]->key);
+                values.push_back(point[j]->value);
+            }
+            descents += pma->write_batch(keys.data(), values.data(), removes.get(), keys.size(), results.get());
+            for(size_t k = i; k<j; k++) std::get<1>(point[k]->reply).set_value(results[k - i]);
+        }
+        i = j;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef ASYNC_PMA_HPP_
+#define ASYNC_PMA_HPP_
+
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <variant>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "defines.hpp"
+#include "JPMA_BT.hpp"
+using namespace std;
+
+/*
+    Asynchronous front end over one PMA. Any thread may submit operations and gets a future back.
+    A dispatcher thread takes everything queued since its last round as one batch, sorts the point
+    operations between two range sums by key and runs them in key order: runs of gets go through
+    lookup_batch, runs of puts and removes through write_batch, where keys of one segment share a descent.
+    Point operations on the same key keep their submission order and a range sum sees exactly the
+    operations submitted before it; other futures may resolve out of submission order. The PMA must
+    not be used directly while the front end runs
+ */
+class AsyncPMA{
+public:
+    enum { OpGet, OpPut, OpRemove, OpRangeSum };
+
+    typedef struct Operation{
+        char op;
+        type_t key;
+        type_t value;                    //End key for OpRangeSum
+        variant<promise<optional<type_t>>, promise<bool>, promise<tuple<type_t, type_t>>> reply;
+    }operation;
+
+    PMA<> *pma;
+    type_t batches = 0, operations = 0, descents = 0;  //Kept by the dispatcher
+
+    AsyncPMA(PMA<> *pma);
+    ~AsyncPMA();
+
+    //Library functions
+    future<optional<type_t>> submit_get(type_t key);
+    future<bool> submit_put(type_t key, type_t value);
+    future<bool> submit_remove(type_t key);
+    future<tuple<type_t, type_t>> submit_range_sum(type_t startKey, type_t endKey);
+
+    //Support functions
+    void enqueue(operation &&o);
+    void dispatch();
+    void runBatch(vector<operation> &batch);
+    void runPoint(vector<operation *> &point);
+
+private:
+    mutex queueLock;
+    condition_variable queued;
+    vector<operation> pending;
+    bool stopping = false;
+    thread dispatcher;
+};
+
+#endif
@@ -4,200 +4,970 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <tuple>
+#include <algorithm>
+#include <thread>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 #include "defines.hpp"
 #include "JPMA_BT.hpp"
 //#include "BPlusTree.hpp"
-#include "diymalloc.h"
 
 using namespace std;
 
 int treeLevel = 0, leafCount = 0;
 
-PMA::PMA(){
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+//NUMA nodes of the machine and the cpus of each, read from sysfs once. A single node if that fails
+typedef struct NumaTopology{
+    int nodes;
+    vector<int> nodeOfCpu;
+    vector<vector<int>> cpus;
+}numaTopology;
+
+//Parses a sysfs list such as "0-3,8-11"
+static vector<int> readSysList(const string &path){
+    vector<int> items;
+    FILE *file = fopen(path.c_str(), "r");
+    if(file == NULL) return items;
+    int low, high;
+    char separator;
+    while(fscanf(file, "%d", &low) == 1){
+        high = low;
+        if(fscanf(file, "%c", &separator) == 1 && separator == '-'){
+            if(fscanf(file, "%d", &high) != 1) break;
+            if(fscanf(file, "%c", &separator) != 1) separator = 0;
+        }
+        for(int i = low; i <= high; i++) items.push_back(i);
+        if(separator != ',') break;
+    }
+    fclose(file);
+    return items;
+}
+
+static const numaTopology &numa(){
+    static const numaTopology topology = [](){
+        numaTopology t;
+        vector<int> online = readSysList("/sys/devices/system/node/online");
+        t.nodes = online.empty() ? 1 : min(online.back() + 1, NumaMaxNodes);
+        t.cpus.resize(t.nodes);
+        for(int node : online){
+            if(node >= t.nodes) break;
+            t.cpus[node] = readSysList("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            for(int cpu : t.cpus[node]){
+                if(cpu >= (int)t.nodeOfCpu.size()) t.nodeOfCpu.resize(cpu + 1, 0);
+                t.nodeOfCpu[cpu] = node;
+            }
+        }
+        return t;
+    }();
+    return topology;
+}
+
+//Node of the cpu the calling thread runs on
+static int currentNode(){
+    int cpu = sched_getcpu();
+    const numaTopology &t = numa();
+    return (cpu >= 0 && cpu < (int)t.nodeOfCpu.size()) ? t.nodeOfCpu[cpu] : 0;
+}
+
+//Binds the calling thread to the cpus of node
+static void runOnNode(int node){
+    const numaTopology &t = numa();
+    if(node >= t.nodes || t.cpus[node].empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : t.cpus[node]) if(cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+//Asks for the pages of [p, p + bytes) on node. Best effort, the kernel falls back to other nodes when it is full
+static void bindToNode(void *p, size_t bytes, int node){
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    if(numa().nodes < 2 || (uintptr_t)p % page != 0) return;
+    unsigned long mask[(NumaMaxNodes + 63) / 64] = {0};
+    mask[node / 64] = 1UL << (node % 64);
+    syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE);
+}
+
+template <typename Key, typename Value, typename Config>
+PMA<Key, Value, Config>::PMA(){
     smallest.push_back(1);                                   //First segment has smallest element 1
     cardinality.push_back(0);                                //First segment contains 0 elements
     totalSegments = 1;                                       //One segment deployed at the start
     lastElementPos.push_back(0);                             //Position of last element in the segment
-    elementsInSegment = SEGMENT_SIZE/sizeof(type_t);
-    lastValidPos = elementsInSegment - 1;
-    blocksInSegment = elementsInSegment / JacobsonIndexSize;
     freeSegmentCount = 0;
-    type_t *starting_key_chunk, *starting_value_chunk;
+    freeKeySegmentBuffer.resize(numa().nodes);
+    freeValueSegmentBuffer.resize(numa().nodes);
+    Key *starting_key_chunk;
+    Value *starting_value_chunk;
     tie(starting_key_chunk, starting_value_chunk) = getSegment();
     
     key_chunks.push_back(starting_key_chunk);
     value_chunks.push_back(starting_value_chunk);
-    tree = new BPlusTree(this);
+    tree = new tree_t(this);
     tree->insertInTree(0, 0, this); //(segment no, dummy key, current JPMA object)
-    vector <u_short> blocks;
+    vector <bitmap_t> blocks;
     for(int i = 0; i<blocksInSegment; i++){
         blocks.push_back(0);
     }
     bitmap.push_back(blocks);
-
-    //Create jacobson Index
-    preCalculateJacobson();
 }
 
-PMA::~PMA(){
-    for(u_int i = 0; i<cleanSegments.size(); i++){
-        delete cleanSegments.back();
-        cleanSegments.pop_back();
-    }
+/*
+    Bulk-loads an already sorted run into a fresh PMA
+ */
+template <typename Key, typename Value, typename Config>
+PMA<Key, Value, Config>::PMA(const Key *sortedKeys, const Value *values, size_t n) : PMA(){
+    bulk_load(sortedKeys, values, n);
 }
 
-void PMA::preCalculateJacobson(){
-    for(int i = 0; i<JacobsonIndexCount; i++){
-        int j, k = 1, idx = 0;
-        u_char count = 0;
-        for(j = 0; j<JacobsonIndexSize; j++){
-            if(i & k) count++;
-            k = k<<1;
-        }
-        NonZeroEntries[i][idx++] = count;
-        k = 1;
-        for(j = 0; j<JacobsonIndexSize; j++){
-            if(i & k) NonZeroEntries[i][idx++] = j;
-            k = k<<1;
-        }
-    }
+template <typename Key, typename Value, typename Config>
+PMA<Key, Value, Config>::~PMA(){
+    disableConcurrency();
+    if(tree->root != NULL) tree->deleteNode(tree->root);
+    delete tree;
+    disable_log();
+    for(u_int i = 0; i<chunks.size(); i++) releaseChunk(chunks[i]);
+    chunks.clear();
+    if(segmentFile >= 0) close(segmentFile);
 }
 
-int PMA::searchSegment(type_t key){
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::searchSegment(Key key){
     return tree->searchSegment(key);
 }
 
-tuple<type_t *, type_t *> PMA::getSegment(){
-    type_t *new_key_chunk, *new_value_chunk;
+template <typename Key, typename Value, typename Config>
+tuple<Key *, Value *> PMA<Key, Value, Config>::getSegment(int node){
+    Key *new_key_chunk;
+    Value *new_value_chunk;
+    //Value chunks hold as many slots as key chunks
+    size_t valueChunkSize = Config::chunkSize / sizeof(Key) * sizeof(Value);
+    if(UNLIKELY(concurrent && totalSegments >= maxSegments)){
+        cout<<"Concurrent PMA ran out of the "<<maxSegments<<" reserved segments"<<endl;
+        exit(0);
+    }
     
-    if(UNLIKELY(freeSegmentCount < 1)){
-        if(Allocation_type == 1){
-            new_key_chunk = (type_t *) mmap(ADDR, CHUNK_SIZE, PROTECTION, FLAGS, -1, 0);
-            if(new_key_chunk == MAP_FAILED){ 
-                cout<<"Cannot allocate the virtual memory: " << CHUNK_SIZE << " bytes. mmap error: " << strerror(errno) << "(" << errno << ")"; 
-                exit(0);
+    if(UNLIKELY(freeKeySegmentBuffer[node].empty())){
+        int64_t fileOffset = -1;
+        SegmentAllocator *source = NULL;
+        if(Allocation_type == 3){
+            chunk c = mapFileChunk();
+            new_key_chunk = c.keys;
+            new_value_chunk = c.values;
+            fileOffset = c.fileOffset;
+        }
+        else{
+            //Only built here, so a file-backed PMA never sets up the default allocators
+            if(allocators.empty()) allocators = SegmentAllocator::chain(Allocation_type);
+            //First allocator of the chain that can serve both halves of the chunk
+            for(u_int a = 0; source == NULL && a<allocators.size(); a++){
+                new_key_chunk = (Key *) allocators[a]->allocate(Config::chunkSize);
+                if(new_key_chunk == NULL) continue;
+                new_value_chunk = (Value *) allocators[a]->allocate(valueChunkSize);
+                if(new_value_chunk == NULL){
+                    allocators[a]->release(new_key_chunk, Config::chunkSize);
+                    continue;
+                }
+                source = allocators[a];
             }
-            new_value_chunk = (type_t *) mmap(ADDR, CHUNK_SIZE, PROTECTION, FLAGS, -1, 0);    
-            if(new_value_chunk == MAP_FAILED){ 
-                cout<<"Cannot allocate the virtual memory: " << CHUNK_SIZE*16 << " bytes. mmap error: " << strerror(errno) << "(" << errno << ")"; 
+            if(source == NULL){
+                cout<<"Cannot allocate a chunk of "<<Config::chunkSize<<" key and "<<valueChunkSize<<" value bytes from any segment allocator"<<endl;
                 exit(0);
             }
         }
-        else{
-            new_key_chunk = (type_t *) malloc (CHUNK_SIZE);
-            new_value_chunk = (type_t *) malloc (CHUNK_SIZE);    
+        if(numaPolicy != NumaFirstTouch){
+            bindToNode(new_key_chunk, Config::chunkSize, node);
+            bindToNode(new_value_chunk, valueChunkSize, node);
         }
-        cleanSegments.push_back(new_key_chunk);
-        cleanSegments.push_back(new_value_chunk);
-
-        freeSegmentCount = CHUNK_SIZE / SEGMENT_SIZE;
-        for(int i = 1; i < freeSegmentCount; i++){
-            freeKeySegmentBuffer.push_back(new_key_chunk + i * elementsInSegment);
-            freeValueSegmentBuffer.push_back(new_value_chunk + i * elementsInSegment);
+        chunk c = {new_key_chunk, new_value_chunk, 1, false, fileOffset, node, source};
+        int at = chunks.empty() ? 0 : chunkOf(new_key_chunk);
+        if(!chunks.empty() && (uintptr_t)chunks[at].keys < (uintptr_t)new_key_chunk) at++;
+        chunks.insert(chunks.begin() + at, c);
+
+        for(int i = 1; i < segmentsInChunk; i++){
+            freeKeySegmentBuffer[node].push_back(new_key_chunk + i * elementsInSegment);
+            freeValueSegmentBuffer[node].push_back(new_value_chunk + i * elementsInSegment);
         }
-        freeSegmentCount--;
+        freeSegmentCount += segmentsInChunk - 1;
     }else{
-        new_key_chunk = freeKeySegmentBuffer.back();
-        new_value_chunk = freeValueSegmentBuffer.back();
-        freeKeySegmentBuffer.pop_back();
-        freeValueSegmentBuffer.pop_back();
+        new_key_chunk = freeKeySegmentBuffer[node].back();
+        new_value_chunk = freeValueSegmentBuffer[node].back();
+        freeKeySegmentBuffer[node].pop_back();
+        freeValueSegmentBuffer[node].pop_back();
         freeSegmentCount--;
+        chunks[chunkOf(new_key_chunk)].live++;
     }
     return {new_key_chunk, new_value_chunk};
 }
 
-bool PMA::insert(type_t key, type_t value, int count){
+/*
+    Index of the chunk segment was carved from (the last chunk starting at or below it)
+ */
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::chunkOf(const Key *segment){
+    int low = 0, high = chunks.size() - 1;
+    while(low < high){
+        int mid = (low + high + 1) / 2;
+        if((uintptr_t)chunks[mid].keys <= (uintptr_t)segment) low = mid;
+        else high = mid - 1;
+    }
+    return low;
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::releaseChunk(chunk &c){
+    size_t valueChunkSize = Config::chunkSize / sizeof(Key) * sizeof(Value);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t keyRegion = (Config::chunkSize + page - 1) / page * page;
+    size_t valueRegion = (valueChunkSize + page - 1) / page * page;
+    if(c.mapped){
+        munmap(c.keys, keyRegion);
+        munmap(c.values, valueRegion);
+    }else if(c.fileOffset >= 0){
+        //The pages go back to the file system as well, the place in the file is reused by the next chunk
+        munmap(c.keys, keyRegion);
+        munmap(c.values, valueRegion);
+        fallocate(segmentFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, c.fileOffset, keyRegion + valueRegion);
+        freeFileOffsets.push_back(c.fileOffset);
+    }else{
+        c.source->release(c.keys, Config::chunkSize);
+        c.source->release(c.values, valueChunkSize);
+    }
+}
+
+/*
+    Allocation_type 3. Maps the key and value regions of a new chunk from the segment file, which is created
+    and unlinked on the first call and grown sparsely. Places of released chunks are used first
+ */
+template <typename Key, typename Value, typename Config>
+typename PMA<Key, Value, Config>::chunk PMA<Key, Value, Config>::mapFileChunk(){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t keyRegion = (Config::chunkSize + page - 1) / page * page;
+    size_t valueRegion = (Config::chunkSize / sizeof(Key) * sizeof(Value) + page - 1) / page * page;
+    if(segmentFile < 0){
+        string name = string(SegmentFileDir) + "/jpma_segments_XXXXXX";
+        segmentFile = mkstemp(&name[0]);
+        if(segmentFile < 0){
+            cout<<"Cannot create the segment file in "<<SegmentFileDir<<": "<<strerror(errno)<<endl;
+            exit(0);
+        }
+        unlink(name.c_str());
+    }
+    chunk c = {NULL, NULL, 1, false, segmentFileBytes, 0, NULL};
+    if(!freeFileOffsets.empty()){
+        c.fileOffset = freeFileOffsets.back();
+        freeFileOffsets.pop_back();
+    }else if(ftruncate(segmentFile, segmentFileBytes + keyRegion + valueRegion) == 0){
+        segmentFileBytes += keyRegion + valueRegion;
+    }else{
+        cout<<"Cannot grow the segment file to "<<segmentFileBytes + keyRegion + valueRegion<<" bytes: "<<strerror(errno)<<endl;
+        exit(0);
+    }
+    c.keys = (Key *) mmap(NULL, keyRegion, PROTECTION, MAP_SHARED, segmentFile, c.fileOffset);
+    c.values = (Value *) mmap(NULL, valueRegion, PROTECTION, MAP_SHARED, segmentFile, c.fileOffset + keyRegion);
+    if(c.keys == MAP_FAILED || c.values == MAP_FAILED){
+        cout<<"Cannot map the segment file at "<<c.fileOffset<<". mmap error: "<<strerror(errno)<<endl;
+        exit(0);
+    }
+    return c;
+}
+
+/*
+    Sets where new chunks go on a NUMA machine. NumaFirstTouch leaves the pages on the node that first
+    writes them. NumaInterleave hands out segments from the nodes in turn. NumaKeyRange splits
+    [minKey, maxKey] into one slice per node and places a segment on the node of its keys, so
+    range_sum_parallel workers, which are then run on the node of their piece, read local memory.
+    Every node has its own pool of free segments. Chunks already allocated stay where they are
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::numa_placement(int policy, Key minKey, Key maxKey){
+    numaPolicy = policy;
+    numaLow = minKey;
+    numaHigh = maxKey;
+}
+
+/*
+    Allocators new chunks are taken from, tried in order until one succeeds. Chunks already allocated
+    go back to the allocator they came from. Not used with Allocation_type 3; an empty chain
+    keeps the default one for Allocation_type
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::set_allocators(const vector<SegmentAllocator *> &chain){
+    allocators = chain;
+}
+
+//Pool a new segment for key is taken from
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::placeNode(Key key){
+    int nodes = freeKeySegmentBuffer.size();
+    if(numaPolicy == NumaInterleave) return numaNext++ % nodes;
+    if(numaPolicy != NumaKeyRange || nodes < 2 || key <= numaLow) return 0;
+    if(key >= numaHigh) return nodes - 1;
+    return min(nodes - 1, (int)(((double)key - (double)numaLow) / ((double)numaHigh - (double)numaLow + 1) * nodes));
+}
+
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::segmentNode(int targetSegment){
+    return chunks[chunkOf(key_chunks[targetSegment])].node;
+}
+
+//True once more than half of the allocated segments are free and at least two chunks' worth of them
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::shrinkDue(){
+    return AutoShrink && freeSegmentCount >= 2 * segmentsInChunk && freeSegmentCount > totalSegments;
+}
+
+/*
+    Gives mostly empty chunks back to the OS. Chunks are taken emptiest first while at most half of them
+    is in use and the free segments of the remaining chunks can hold their live ones. Those are copied
+    over, then the chunks are unmapped (freed with Allocation_type 2). In concurrent mode this runs under
+    layoutLock, each copy under the lock of its segment only since the tree does not change, and the chunks
+    are kept until disableConcurrency since readers may still be on them. Returns the number of bytes released
+ */
+template <typename Key, typename Value, typename Config>
+size_t PMA<Key, Value, Config>::shrink_to_fit(){
+    unique_lock<mutex> layout(layoutLock, defer_lock);
+    if(concurrent) layout.lock();
+    vector<int> order(chunks.size());
+    for(size_t c = 0; c<chunks.size(); c++) order[c] = c;
+    sort(order.begin(), order.end(), [&](int a, int b){ return chunks[a].live < chunks[b].live; });
+
+    vector<bool> release(chunks.size(), false);
+    int room = freeSegmentCount, moving = 0;           //Free segments outside the released chunks, live ones inside
+    for(int c : order){
+        int freeInChunk = segmentsInChunk - chunks[c].live;
+        if(chunks[c].live * 2 > segmentsInChunk || room - freeInChunk < moving + chunks[c].live) break;
+        release[c] = true;
+        room -= freeInChunk;
+        moving += chunks[c].live;
+    }
+
+    //Drop the free segments of released chunks, then move their live segments into what is left,
+    //on the same node while its pool lasts
+    size_t kept = 0;
+    freeSegmentCount = 0;
+    for(u_int node = 0; node<freeKeySegmentBuffer.size(); node++){
+        vector<Key *> &keyPool = freeKeySegmentBuffer[node];
+        vector<Value *> &valuePool = freeValueSegmentBuffer[node];
+        kept = 0;
+        for(size_t i = 0; i<keyPool.size(); i++){
+            if(release[chunkOf(keyPool[i])]) continue;
+            keyPool[kept] = keyPool[i];
+            valuePool[kept++] = valuePool[i];
+        }
+        keyPool.resize(kept);
+        valuePool.resize(kept);
+        freeSegmentCount += kept;
+    }
+    for(int i = 0; moving > 0 && i<totalSegments; i++){
+        int from = chunkOf(key_chunks[i]);
+        if(!release[from]) continue;
+        u_int node = chunks[from].node;
+        for(u_int n = 0; freeKeySegmentBuffer[node].empty() && n<freeKeySegmentBuffer.size(); n++) node = n;
+        Key *new_key_chunk = freeKeySegmentBuffer[node].back();
+        Value *new_value_chunk = freeValueSegmentBuffer[node].back();
+        freeKeySegmentBuffer[node].pop_back();
+        freeValueSegmentBuffer[node].pop_back();
+        freeSegmentCount--;
+        chunks[chunkOf(new_key_chunk)].live++;
+        if(concurrent) lockVersion(segmentVersion[i]);
+        memcpy(new_key_chunk, key_chunks[i], elementsInSegment * sizeof(Key));
+        memcpy((void *)new_value_chunk, value_chunks[i], elementsInSegment * sizeof(Value));
+        key_chunks[i] = new_key_chunk;
+        value_chunks[i] = new_value_chunk;
+        if(concurrent) unlockVersion(segmentVersion[i]);
+        moving--;
+    }
+
+    size_t released = 0;
+    kept = 0;
+    for(size_t c = 0; c<chunks.size(); c++){
+        if(!release[c]){
+            chunks[kept++] = chunks[c];
+            continue;
+        }
+        if(concurrent) retiredChunks.push_back(chunks[c]);
+        else releaseChunk(chunks[c]);
+        released += Config::chunkSize + Config::chunkSize / sizeof(Key) * sizeof(Value);
+    }
+    chunks.resize(kept);
+    return released;
+}
+
+//Fixed part of a snapshot file. The segment table, the bitmaps and the tree follow it, the chunks start
+//at dataOffset and each key and value region is padded to whole pages so open can map them in place
+struct SnapshotHeader{
+    char magic[8];
+    uint32_t keyBytes, valueBytes, segmentSize, treeDegree, leafDegree, pageBytes;
+    uint64_t chunkSize;
+    int64_t totalSegments, chunkCount, metaBytes, dataOffset;
+};
+static const char SnapshotMagic[8] = {'J', 'P', 'M', 'A', 'S', 'N', 'P', '1'};
+
+template <typename T>
+static inline void putRaw(vector<char> &out, const T *p, size_t count){
+    out.insert(out.end(), (const char *)p, (const char *)(p + count));
+}
+
+template <typename T>
+static inline bool getRaw(const char *&in, const char *end, T *p, size_t count){
+    if((size_t)(end - in) < count * sizeof(T)) return false;
+    memcpy((void *)p, in, count * sizeof(T));
+    in += count * sizeof(T);
+    return true;
+}
+
+/*
+    Writes the PMA to a snapshot file: the chunks as they are laid out, gaps and free segments included,
+    the segment metadata and the tree. The file is written next to path and renamed over it, so a PMA
+    opened from path keeps its pages. Single-threaded mode only
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::save(const char *path){
+    if(concurrent){
+        cout<<"Cannot save a PMA in concurrent mode"<<endl;
+        return false;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t valueChunkSize = Config::chunkSize / sizeof(Key) * sizeof(Value);
+    size_t keyRegion = (Config::chunkSize + page - 1) / page * page;
+    size_t valueRegion = (valueChunkSize + page - 1) / page * page;
+
+    //Segments are stored as (chunk, slot), the value segment sits at the same slot of the value chunk
+    vector<char> meta;
+    for(int i = 0; i<totalSegments; i++){
+        int32_t at[2];
+        at[0] = chunkOf(key_chunks[i]);
+        at[1] = (key_chunks[i] - chunks[at[0]].keys) / elementsInSegment;
+        putRaw(meta, at, 2);
+    }
+    putRaw(meta, smallest.data(), totalSegments);
+    putRaw(meta, cardinality.data(), totalSegments);
+    putRaw(meta, lastElementPos.data(), totalSegments);
+    for(int i = 0; i<totalSegments; i++) putRaw(meta, bitmap[i].data(), blocksInSegment);
+    tree->saveNode(tree->root, meta);
+
+    SnapshotHeader header;
+    memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+    header.keyBytes = sizeof(Key);
+    header.valueBytes = sizeof(Value);
+    header.segmentSize = Config::segmentSize;
+    header.treeDegree = Config::treeDegree;
+    header.leafDegree = Config::leafDegree;
+    header.pageBytes = page;
+    header.chunkSize = Config::chunkSize;
+    header.totalSegments = totalSegments;
+    header.chunkCount = chunks.size();
+    header.metaBytes = meta.size();
+    header.dataOffset = (sizeof(header) + meta.size() + page - 1) / page * page;
+
+    string staging = string(path) + ".tmp";
+    FILE *file = fopen(staging.c_str(), "wb");
+    if(file == NULL){
+        cout<<"Cannot create snapshot "<<staging<<": "<<strerror(errno)<<endl;
+        return false;
+    }
+    vector<char> padding(page, 0);
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(meta.data(), 1, meta.size(), file) == meta.size()
+                && fwrite(padding.data(), 1, header.dataOffset - sizeof(header) - meta.size(), file) == header.dataOffset - sizeof(header) - meta.size();
+    for(u_int c = 0; written && c<chunks.size(); c++){
+        written = fwrite(chunks[c].keys, 1, Config::chunkSize, file) == Config::chunkSize
+               && fwrite(padding.data(), 1, keyRegion - Config::chunkSize, file) == keyRegion - Config::chunkSize
+               && fwrite((const void *)chunks[c].values, 1, valueChunkSize, file) == valueChunkSize
+               && fwrite(padding.data(), 1, valueRegion - valueChunkSize, file) == valueRegion - valueChunkSize;
+    }
+    written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = (fclose(file) == 0) && written;
+    if(!written || rename(staging.c_str(), path) != 0){
+        cout<<"Cannot write snapshot "<<path<<": "<<strerror(errno)<<endl;
+        unlink(staging.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+    Replaces the contents of the PMA with a snapshot written by save. The file is mapped privately and
+    its chunks are used in place, a page is copied on its first write and the file itself never changes.
+    Only the segment metadata and the tree are read up front. Returns false, leaving the PMA as it was,
+    if the file cannot be mapped or was written with another key, value or geometry
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::open(const char *path){
+    if(concurrent){
+        cout<<"Cannot open a snapshot in concurrent mode"<<endl;
+        return false;
+    }
+    int fd = ::open(path, O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0){
+        cout<<"Cannot open snapshot "<<path<<": "<<strerror(errno)<<endl;
+        if(fd >= 0) close(fd);
+        return false;
+    }
+    size_t fileBytes = info.st_size;
+    char *base = fileBytes < sizeof(SnapshotHeader) ? (char *)MAP_FAILED
+               : (char *)mmap(NULL, fileBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        cout<<"Cannot map snapshot "<<path<<endl;
+        return false;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t valueChunkSize = Config::chunkSize / sizeof(Key) * sizeof(Value);
+    size_t keyRegion = (Config::chunkSize + page - 1) / page * page;
+    size_t valueRegion = (valueChunkSize + page - 1) / page * page;
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    bool valid = memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0
+              && header.keyBytes == sizeof(Key) && header.valueBytes == sizeof(Value)
+              && header.segmentSize == Config::segmentSize && header.chunkSize == Config::chunkSize
+              && header.treeDegree == Config::treeDegree && header.leafDegree == Config::leafDegree
+              && header.pageBytes == page && header.totalSegments > 0 && header.chunkCount > 0
+              && header.metaBytes >= 0 && header.dataOffset % page == 0
+              && (size_t)header.dataOffset >= sizeof(header) + header.metaBytes
+              && (size_t)header.dataOffset + header.chunkCount * (keyRegion + valueRegion) == fileBytes;
+
+    //Segment table. Every (chunk, slot) may be used by one segment only
+    int segments = valid ? header.totalSegments : 0;
+    const char *in = base + sizeof(header), *end = in + (valid ? header.metaBytes : 0);
+    vector<int32_t> at(2 * segments);
+    vector<Key> loadSmallest(segments);
+    vector<int> loadCardinality(segments);
+    vector<type_t> loadLastElementPos(segments);
+    vector<vector<bitmap_t>> loadBitmap(segments, vector<bitmap_t>(blocksInSegment));
+    valid = valid && getRaw(in, end, at.data(), 2 * segments) && getRaw(in, end, loadSmallest.data(), segments)
+                  && getRaw(in, end, loadCardinality.data(), segments) && getRaw(in, end, loadLastElementPos.data(), segments);
+    for(int i = 0; valid && i<segments; i++) valid = getRaw(in, end, loadBitmap[i].data(), blocksInSegment);
+    vector<bool> used(valid ? header.chunkCount * segmentsInChunk : 0, false);
+    for(int i = 0; valid && i<segments; i++){
+        valid = at[2*i] >= 0 && at[2*i] < header.chunkCount && at[2*i+1] >= 0 && at[2*i+1] < segmentsInChunk
+             && !used[at[2*i] * segmentsInChunk + at[2*i+1]];
+        if(valid) used[at[2*i] * segmentsInChunk + at[2*i+1]] = true;
+    }
+
+    tree_t *loadTree = new tree_t(this);
+    typename tree_t::leaf *prev = NULL;
+    if(valid) loadTree->root = loadTree->loadNode(in, end, segments, prev, 0);
+    vector<int> listed;
+    if(loadTree->root != NULL) loadTree->listSegments(listed, loadTree->root);
+    if(!valid || loadTree->root == NULL || in != end || listed.size() != (size_t)segments){
+        cout<<"Snapshot "<<path<<" does not match this PMA or is damaged"<<endl;
+        if(loadTree->root != NULL) loadTree->deleteNode(loadTree->root);
+        delete loadTree;
+        munmap(base, fileBytes);
+        return false;
+    }
+
+    //Drop the current contents, then hand out the mapped chunks
+    for(u_int c = 0; c<chunks.size(); c++) releaseChunk(chunks[c]);
+    chunks.clear();
+    for(u_int node = 0; node<freeKeySegmentBuffer.size(); node++){
+        freeKeySegmentBuffer[node].clear();
+        freeValueSegmentBuffer[node].clear();
+    }
+    freeSegmentCount = 0;
+    if(tree->root != NULL) tree->deleteNode(tree->root);
+    delete tree;
+    tree = loadTree;
+
+    for(int64_t c = 0; c<header.chunkCount; c++){
+        char *keys = base + header.dataOffset + c * (keyRegion + valueRegion);
+        chunk mappedChunk = {(Key *)keys, (Value *)(keys + keyRegion), 0, true, -1, 0, NULL};
+        chunks.push_back(mappedChunk);
+        for(int slot = 0; slot<segmentsInChunk; slot++){
+            if(used[c * segmentsInChunk + slot]) chunks[c].live++;
+            else{
+                freeKeySegmentBuffer[0].push_back(chunks[c].keys + slot * elementsInSegment);
+                freeValueSegmentBuffer[0].push_back(chunks[c].values + slot * elementsInSegment);
+                freeSegmentCount++;
+            }
+        }
+    }
+    totalSegments = segments;
+    key_chunks.resize(segments);
+    value_chunks.resize(segments);
+    for(int i = 0; i<segments; i++){
+        key_chunks[i] = chunks[at[2*i]].keys + at[2*i+1] * elementsInSegment;
+        value_chunks[i] = chunks[at[2*i]].values + at[2*i+1] * elementsInSegment;
+    }
+    smallest.swap(loadSmallest);
+    cardinality.swap(loadCardinality);
+    lastElementPos.swap(loadLastElementPos);
+    bitmap.swap(loadBitmap);
+    munmap(base, header.dataOffset);                //Header, segment table and tree were copied out
+    return true;
+}
+
+/*
+    Logs every insert, remove, upsert and update from now on to path. With WriteAheadLog::LogSync a write
+    returns once its record is durable, writers running at the same time share one sync. With LogAsync the
+    log is synced in the background and a crash may lose the last LogSyncInterval milliseconds.
+    An existing log is continued unless truncate is set, e.g. right after a save
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::enable_log(const char *path, int mode, bool truncate){
+    disable_log();
+    wal = new WriteAheadLog(mode, sizeof(Key), sizeof(Value));
+    if(wal->start(path, truncate)) return true;
+    delete wal;
+    wal = NULL;
+    return false;
+}
+
+//Makes the log durable and closes it
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::disable_log(){
+    if(wal == NULL) return;
+    wal->flush();
+    delete wal;
+    wal = NULL;
+}
+
+/*
+    Applies the records of the log at path to this PMA, an empty one or one just opened from a snapshot.
+    A torn record at the end is ignored. Writes made here are not logged again.
+    Returns the number of records applied, -1 if path is not a log for this key and value type
+ */
+template <typename Key, typename Value, typename Config>
+int64_t PMA<Key, Value, Config>::replay_log(const char *path){
+    WriteAheadLog *logging = wal;
+    wal = NULL;
+    uint64_t validBytes;
+    int64_t count = WriteAheadLog::scan(path, sizeof(Key), sizeof(Value), [this](char op, const char *keyBytes, const char *valueBytes){
+        Key key;
+        Value value;
+        memcpy(&key, keyBytes, sizeof(Key));
+        if(valueBytes != NULL) memcpy((void *)&value, valueBytes, sizeof(Value));
+        if(op == WriteAheadLog::RecordInsert) insert(key, value);
+        else if(op == WriteAheadLog::RecordUpsert) upsert(key, value);
+        else remove(key);
+    }, validBytes);
+    wal = logging;
+    return count;
+}
+
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::insert(Key key, Value value, int count){
+    int targetSegment = beginWrite(key);
     //Find the location using Binary Search.
-    int targetSegment = tree->searchSegment(key);
-    
     type_t position = findLocation(key, targetSegment);
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t foundKey = *(segmentOffset + position);
-    if(foundKey == key) return false;
+    bool inserted = insertInSegment(targetSegment, position, key, value, count);
+    uint64_t logged = inserted ? logWrite(WriteAheadLog::RecordInsert, key, &value) : 0;
+    endWrite(targetSegment);
+    logCommit(logged);
+    return inserted;
+}
+
+/*
+    Inserts key, or overwrites the value if key is present. Returns true if key was inserted
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::upsert(Key key, Value value){
+    int targetSegment = beginWrite(key);
+    type_t position = findLocation(key, targetSegment);
+    bool inserted = false;
+    if(key_chunks[targetSegment][position] == key && isOccupied(targetSegment, position)) value_chunks[targetSegment][position] = value;
+    else inserted = insertInSegment(targetSegment, position, key, value, 0);
+    uint64_t logged = logWrite(WriteAheadLog::RecordUpsert, key, &value);
+    endWrite(targetSegment);
+    logCommit(logged);
+    return inserted;
+}
+
+/*
+    Applies a run of upserts and removes (removes[i] set) sorted by key, a key may repeat and its
+    operations are applied in run order. Keys up to the largest one held by the segment found for the
+    first key are routed there too, so they share its descent and segment lock; the run takes a new
+    descent after a write leaves the segment full or a remove leaves it sparse. results[i] is what upsert
+    or remove would have returned. Returns the number of descents
+ */
+template <typename Key, typename Value, typename Config>
+size_t PMA<Key, Value, Config>::write_batch(const Key *keys, const Value *values, const bool *removes, size_t n, bool *results){
+    size_t descents = 0, i = 0;
+    while(i < n){
+        int targetSegment = beginWrite(keys[i]);
+        descents++;
+        uint64_t logged = 0;
+        bool removed = false;
+        do{
+            Key key = keys[i];
+            type_t position = findLocation(key, targetSegment);
+            bool present = key_chunks[targetSegment][position] == key && isOccupied(targetSegment, position);
+            if(removes[i]){
+                if(present){
+                    deleteInPosition(position, targetSegment, key);
+                    removed = true;
+                    logged = max(logged, logWrite(WriteAheadLog::RecordRemove, key, NULL));
+                }
+                results[i] = present;
+            }
+            else{
+                if(present) value_chunks[targetSegment][position] = values[i];
+                results[i] = !present && insertInSegment(targetSegment, position, key, values[i], 0);
+                logged = max(logged, logWrite(WriteAheadLog::RecordUpsert, key, &values[i]));
+            }
+            i++;
+            if(cardinality[targetSegment] > (tree->level[0]*elementsInSegment)) break;
+            if(removed && cardinality[targetSegment] < (tree->lowerLevel*elementsInSegment)) break;
+        }while(i < n && keys[i] <= key_chunks[targetSegment][lastElementPos[targetSegment]]);
+        endWrite(targetSegment, removed);
+        logCommit(logged);
+    }
+    return descents;
+}
+
+/*
+    Appends a record for a write to the log while the segment is still held, so records of one key are
+    logged in the order they were applied. Returns the position to pass to logCommit after endWrite, 0 with no log
+ */
+template <typename Key, typename Value, typename Config>
+uint64_t PMA<Key, Value, Config>::logWrite(char op, Key key, const Value *value){
+    if(wal == NULL) return 0;
+    return wal->append(op, &key, value);
+}
+
+//In sync mode, waits until the log is durable up to position
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::logCommit(uint64_t position){
+    if(wal != NULL && position > 0) wal->waitDurable(position);
+}
+
+/*
+    Routes key to its segment for a write and, in concurrent mode, locks the segment
+ */
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::beginWrite(Key key){
+    if(!concurrent) return tree->searchSegment(key, writePath);
+    while(true){
+        uint64_t treeSeen = readVersion(treeVersion);
+        if(UNLIKELY(treeSeen & 1)){
+            _mm_pause();
+            continue;
+        }
+        int targetSegment = tree->searchSegment(key);
+        if(!validateVersion(treeVersion, treeSeen)) continue;
+        lockVersion(segmentVersion[targetSegment]);
+        //The segment may have been split while waiting for it
+        if(validateVersion(treeVersion, treeSeen)) return targetSegment;
+        unlockVersion(segmentVersion[targetSegment]);
+    }
+}
+
+/*
+    Ends a write started with beginWrite, redistributing the segment if it went over the upper
+    threshold or, when the write removed elements, merging it with a neighbour if it went under the lower one
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::endWrite(int targetSegment, bool removed){
+    bool full = cardinality[targetSegment] > (tree->level[0]*elementsInSegment);
+    bool sparse = removed && cardinality[targetSegment] < (tree->lowerLevel*elementsInSegment);
+    if(!concurrent){
+        if(full) tree->redistributeInsert(targetSegment, smallest[targetSegment], this, writePath);
+        else if(sparse){
+            tree->redistributeRemove(targetSegment, smallest[targetSegment], this, writePath);
+            if(shrinkDue()) shrink_to_fit();
+        }
+        return;
+    }
+    unlockVersion(segmentVersion[targetSegment]);
+    if(full) splitConcurrent(targetSegment);
+    else if(sparse) mergeConcurrent(targetSegment);
+}
+
+/*
+    Locks the slot of key for a read-modify-write (see update). Returns NULL if key is not present,
+    releaseValue must be called in both cases
+ */
+template <typename Key, typename Value, typename Config>
+Value *PMA<Key, Value, Config>::acquireValue(Key key, int &targetSegment){
+    targetSegment = beginWrite(key);
+    type_t position = findLocation(key, targetSegment);
+    if(key_chunks[targetSegment][position] != key || !isOccupied(targetSegment, position)) return NULL;
+    return value_chunks[targetSegment] + position;
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::releaseValue(int targetSegment){
+    if(concurrent) unlockVersion(segmentVersion[targetSegment]);
+}
+
+/*
+    Places key at position in targetSegment (position from findLocation). Redistribution is left to the caller
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::insertInSegment(int targetSegment, type_t position, Key key, Value value, int count){
+    Key * segmentOffset = key_chunks[targetSegment];
+    Key foundKey = *(segmentOffset + position);
+    if(foundKey == key && isOccupied(targetSegment, position)) return false;
     //cout<<"Got location: "<<position<<" Segment: "<<targetSegment<<" cardinality: "<<cardinality[targetSegment]<<" for Key: "<<key<<endl;
 
     //Check if the current location is empty
     int blockNo = position/JacobsonIndexSize;
     int bitPosition = position % JacobsonIndexSize;
-    u_short mask =  1 << bitPosition;
+    bitmap_t mask = 1ULL << bitPosition;
     if((bitmap[targetSegment][blockNo] & mask) == 0){
         insertInPosition(position, targetSegment, key, value);
-        if(cardinality[targetSegment] > (tree->level[0]*SEGMENT_SIZE/8)) tree->redistributeInsert(targetSegment, smallest[targetSegment], this);
         return true;
     }
 
     //check if need traversing from backside
     if(position >= lastElementPos[targetSegment]){
-        if(!insertAfterLast(position, key, value, targetSegment, foundKey, count)) return false;
-        if(cardinality[targetSegment] > (tree->level[0]*SEGMENT_SIZE/8)) tree->redistributeInsert(targetSegment, smallest[targetSegment], this);
-        return true;
+        return insertAfterLast(position, key, value, targetSegment, foundKey, count);
     }
 
-    //Insert among other inserted elements 
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    //type_t * segmentKeyOffset = key_chunks[targetSegment];
-    int pBase = blockNo * JacobsonIndexSize;
-    int insertPos = pBase;
-    while(true){
-        if(UNLIKELY(ar[0] == 0)){//Got a complete emply block. select the first cell. This can not be the starting block
-            insertPos = pBase;
-            break;
-        }
-        else if(ar[0] == JacobsonIndexSize){
-            blockNo++;
-            if(blockNo == blocksInSegment){
-                if(!backSearchInsert(position, key, value, targetSegment, lastValidPos+position)) return false;
-                if(cardinality[targetSegment] > (tree->level[0]*SEGMENT_SIZE/8)) tree->redistributeInsert(targetSegment, smallest[targetSegment], this); 
-                return true;
-            }
-            ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-            pBase += JacobsonIndexSize;
-            insertPos = pBase;
-        }else{
-            //Before first element of the block
-            if(ar[1] != 0 && position <= pBase){
-                insertPos = pBase;
-                break;
-            } 
-            //In between other inserted elements in the block
-            bool got = false;
-            for(int j = 2; j <= ar[0]; j++){
-                if(ar[j]-ar[j-1] > 1 && pBase+ar[j-1] >= position) {
-                    insertPos += ar[j-1] + 1;
-                    got = true;
-                    break;
-                }
-            }
-            //after last element
-            if(UNLIKELY(!got)){
-                if(ar[ar[0]] == JacobsonIndexSize-1){
-                    blockNo++;
-                    if(blockNo == blocksInSegment){
-                        if(!backSearchInsert(position, key, value, targetSegment, lastValidPos+position)) return false;
-                        if(cardinality[targetSegment] > (tree->level[0]*SEGMENT_SIZE/8)) tree->redistributeInsert(targetSegment, smallest[targetSegment], this);
-                        return true;
-                    }
-                    ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-                    pBase += JacobsonIndexSize;
-                    insertPos = pBase;
-                }else{
-                    insertPos += ar[ar[0]] + 1;
-                    break;
-                }
-            }else break;
-        }
-    }
+    //Insert among other inserted elements. Take the first free slot after position (if any),
+    //backSearchInsert compares it with the nearest one before position
+    type_t insertPos = nextFreeSlot(targetSegment, position);
+    if(UNLIKELY(insertPos < 0)) insertPos = lastValidPos + position;
 
     if(LIKELY(!backSearchInsert(position, key, value, targetSegment, insertPos))){
         cout<<"error in inserting"<<endl;
         exit(0);
     }
-    if(cardinality[targetSegment] > (tree->level[0]*SEGMENT_SIZE/8)) tree->redistributeInsert(targetSegment, smallest[targetSegment], this);
     return true;
 }
 
-bool PMA::insertForward(type_t position, type_t key, type_t value, int targetSegment, int insertPos){
+/*
+    Inserts a run of key-value pairs. The run is sorted (if needed), split into groups that
+    route to the same segment and each group is merged into its segment in one pass.
+    Returns the number of keys inserted (existing keys are skipped like in insert). Single-threaded mode only
+ */
+template <typename Key, typename Value, typename Config>
+size_t PMA<Key, Value, Config>::insert_batch(const Key *keys, const Value *values, size_t n){
+    if(concurrent){
+        cout<<"insert_batch cannot be used in concurrent mode, disable concurrency first"<<endl;
+        exit(0);
+    }
+    if(n == 0) return 0;
+    vector<tuple<Key, Value>> run(n);
+    bool sorted = true;
+    for(size_t i = 0; i<n; i++){
+        run[i] = make_tuple(keys[i], values[i]);
+        if(i > 0 && keys[i] < keys[i-1]) sorted = false;
+    }
+    if(!sorted){
+        stable_sort(run.begin(), run.end(), [](const tuple<Key, Value> &a, const tuple<Key, Value> &b){
+            return std::get<0>(a) < std::get<0>(b);
+        });
+    }
+
+    //Drop duplicates inside the batch, the first occurrence wins
+    vector<Key> runKeys;
+    vector<Value> runValues;
+    runKeys.reserve(n);
+    runValues.reserve(n);
+    for(size_t i = 0; i<n; i++){
+        if(!runKeys.empty() && runKeys.back() == std::get<0>(run[i])) continue;
+        runKeys.push_back(std::get<0>(run[i]));
+        runValues.push_back(std::get<1>(run[i]));
+    }
+
+    //Replaying the run as single inserts gives the same result, keys already present are kept either way
+    uint64_t logged = 0;
+    for(size_t k = 0; wal != NULL && k<runKeys.size(); k++) logged = logWrite(WriteAheadLog::RecordInsert, runKeys[k], &runValues[k]);
+
+    size_t inserted = 0, i = 0, total = runKeys.size();
+    while(i < total){
+        Key upperBound;
+        int targetSegment = tree->searchSegment(runKeys[i], upperBound);
+        size_t j = i + 1;
+        while(j < total && runKeys[j] < upperBound) j++;
+        inserted += mergeIntoSegment(targetSegment, &runKeys[i], &runValues[i], j - i);
+        i = j;
+    }
+    logCommit(logged);
+    return inserted;
+}
+
+/*
+    Loads a sorted run into an empty PMA. Segments are filled to the level[0] density in one pass
+    and the tree is built bottom-up over them. A non-empty PMA or unsorted input goes through insert_batch.
+    Single-threaded mode only
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::bulk_load(const Key *sortedKeys, const Value *values, size_t n){
+    if(concurrent){
+        cout<<"bulk_load cannot be used in concurrent mode, disable concurrency first"<<endl;
+        exit(0);
+    }
+    if(n == 0) return;
+    bool sorted = true, duplicates = false;
+    for(size_t i = 1; i<n && sorted; i++){
+        if(sortedKeys[i] < sortedKeys[i-1]) sorted = false;
+        else if(sortedKeys[i] == sortedKeys[i-1]) duplicates = true;
+    }
+    if(!sorted || totalSegments != 1 || cardinality[0] != 0){
+        insert_batch(sortedKeys, values, n);
+        return;
+    }
+
+    //Drop duplicates, the first occurrence wins
+    vector<Key> runKeys;
+    vector<Value> runValues;
+    const Key *loadKeys = sortedKeys;
+    const Value *loadValues = values;
+    size_t total = n;
+    if(duplicates){
+        runKeys.reserve(n);
+        runValues.reserve(n);
+        for(size_t i = 0; i<n; i++){
+            if(i > 0 && sortedKeys[i] == sortedKeys[i-1]) continue;
+            runKeys.push_back(sortedKeys[i]);
+            runValues.push_back(values[i]);
+        }
+        loadKeys = &runKeys[0];
+        loadValues = &runValues[0];
+        total = runKeys.size();
+    }
+    uint64_t logged = 0;
+    for(size_t k = 0; wal != NULL && k<total; k++) logged = logWrite(WriteAheadLog::RecordInsert, loadKeys[k], &loadValues[k]);
+
+    type_t capacity = (type_t)(tree->level[0]*elementsInSegment);
+    type_t pieces = (total + capacity - 1) / capacity;
+    type_t perPiece = total / pieces, extra = total % pieces, offset = 0;
+    vector<int> segments;
+    segments.reserve(pieces);
+    for(type_t p = 0; p < pieces; p++){
+        type_t pieceCount = perPiece + (p < extra ? 1 : 0);
+        if(p > 0){
+            Key *new_key_chunk;
+            Value *new_value_chunk;
+            tie(new_key_chunk, new_value_chunk) = getSegment(placeNode(loadKeys[offset]));
+            key_chunks.push_back(new_key_chunk);
+            value_chunks.push_back(new_value_chunk);
+            smallest.push_back(loadKeys[offset]);     //The first segment keeps its bound, it also takes the keys below the run
+            lastElementPos.push_back(0);
+            cardinality.push_back(0);
+            addBitmap(vector<bitmap_t>(blocksInSegment, 0));
+            totalSegments++;
+        }
+        int segNo = totalSegments - 1;
+        layoutSegment(segNo, loadKeys + offset, loadValues + offset, pieceCount);
+        segments.push_back(segNo);
+        offset += pieceCount;
+    }
+    tree->buildFromSegments(segments, this);
+    logCommit(logged);
+}
+
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::insertForward(type_t position, Key key, Value value, int targetSegment, int insertPos){
     /*
     if(UNLIKELY(insertPos > lastValidPos)) {
         cout<<" No place found for inserting"<<endl;
@@ -207,7 +977,7 @@ bool PMA::insertForward(type_t position, type_t key, type_t value, int targetSeg
     //cout<<"inserting forward. position: "<<position<<" final pos: "<<insertPos<<endl;
     insertInPosition(insertPos, targetSegment, key, value);
 
-    type_t * movePos = key_chunks[targetSegment] + insertPos;
+    Key * movePos = key_chunks[targetSegment] + insertPos;
     while(*movePos < *(movePos-1)){
         swapElements(targetSegment, insertPos-1, 1);
         insertPos--;
@@ -217,11 +987,12 @@ bool PMA::insertForward(type_t position, type_t key, type_t value, int targetSeg
     return true;
 }
 
-bool PMA::insertBackward(type_t position, type_t key, type_t value, int targetSegment, int insertPos){
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::insertBackward(type_t position, Key key, Value value, int targetSegment, int insertPos){
     //cout<<"inserting backward. position: "<<position<<" final pos: "<<insertPos<<endl;
-    type_t * segmentKeyOffset = key_chunks[targetSegment];
+    Key * segmentKeyOffset = key_chunks[targetSegment];
     insertInPosition(insertPos, targetSegment, key, value);   
-    type_t * moveback = segmentKeyOffset + insertPos;
+    Key * moveback = segmentKeyOffset + insertPos;
     while(*moveback > *(moveback+1)){
         swapElements(targetSegment, insertPos, 1);
         insertPos++;
@@ -231,25 +1002,19 @@ bool PMA::insertBackward(type_t position, type_t key, type_t value, int targetSe
     return true;
 }
 
-bool PMA::insertAfterLast(type_t position, type_t key, type_t value, int targetSegment, type_t foundKey, int count) {
-    //type_t * segmentKeyOffset = key_chunks[targetSegment];
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::insertAfterLast(type_t position, Key key, Value value, int targetSegment, Key foundKey, int count) {
+    //Key * segmentKeyOffset = key_chunks[targetSegment];
     if(UNLIKELY(position == lastValidPos)){ //Got out of the current segment. Traverse backward for vacant space
         //return backSearchInsert(position, key, value, targetSegment, lastValidPos+position);
-        for(type_t i = lastValidPos-1; i>=0; i--){
-            int blockNo = i/JacobsonIndexSize;
-            int bitPosition = i % JacobsonIndexSize;
-            u_short mask =  1 << bitPosition;
-
-            if((bitmap[targetSegment][blockNo] & mask) == 0) {
-                return insertBackward(position, key, value, targetSegment, i);
-            }
-        }
+        type_t i = prevFreeSlot(targetSegment, lastValidPos-1);
+        if(LIKELY(i >= 0)) return insertBackward(position, key, value, targetSegment, i);
         cout<<"Program should never reach hear at InsertAfterLast"<<endl;
         exit(0);
     }
     else{ //Have some space left in the segment. Go forward in the space max 3 slots
-        type_t adjust = min(lastValidPos - lastElementPos[targetSegment], (type_t) MaxGap);
-        adjust = min(adjust, abs(*(key_chunks[targetSegment]+lastElementPos[targetSegment])-key));
+        type_t adjust = min(lastValidPos - lastElementPos[targetSegment], (type_t) Config::maxGap);
+        adjust = min(adjust, abs((type_t) *(key_chunks[targetSegment]+lastElementPos[targetSegment]) - (type_t) key));
         if(key > foundKey){
             //cout<<"inserting forward. position: "<<position<<" final pos: "<<position+adjust<<endl;
             insertInPosition(position+adjust, targetSegment, key, value);
@@ -264,613 +1029,1430 @@ bool PMA::insertAfterLast(type_t position, type_t key, type_t value, int targetS
     }
 }
 
-bool PMA::backSearchInsert(type_t position, type_t key, type_t value, int targetSegment, int forwardInsertPos) {
-    type_t blockNo = position/JacobsonIndexSize; 
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    type_t insertPos = blockNo * JacobsonIndexSize;
-    
-    while(true){
-        if(ar[0] == 0){//Got a complete empty block. select the last cell
-            insertPos += JacobsonIndexSize - 1;
-            break;
-        }
-        else if(ar[0] == JacobsonIndexSize){ //Fully loaded block
-            blockNo--;
-            if(blockNo < 0){
-                return insertForward(position, key, value, targetSegment, forwardInsertPos);
-            }
-            ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-            insertPos -= JacobsonIndexSize;
-        }else{
-            int elements = ar[0];
-            bool got = false;
-            if(ar[elements] < (JacobsonIndexSize - 1) && insertPos + ar[elements] < position){
-                insertPos += JacobsonIndexSize - 1;
-                got = true;
-            }else{
-                for(int j = elements; j > 1; j--){
-                    if(ar[j]-ar[j-1] > 1 && insertPos + ar[j] <= position) {
-                        insertPos += ar[j] - 1;
-                        got = true;
-                        break;
-                    }
-                }
-            }
-            if(!got){
-                if(ar[1] == 0){
-                    blockNo--;
-                    if(blockNo < 0){
-                        return insertForward(position, key, value, targetSegment, forwardInsertPos);
-                    }
-                    
-                    ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-                    insertPos -= JacobsonIndexSize;
-                }else{
-                    insertPos += ar[1] - 1;
-                    break;
-                }
-            }else break;
-        }
-
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::backSearchInsert(type_t position, Key key, Value value, int targetSegment, int forwardInsertPos) {
+    type_t insertPos = prevFreeSlot(targetSegment, position);
+    if(insertPos < 0){
+        return insertForward(position, key, value, targetSegment, forwardInsertPos);
     }
-    //if(insertPos < 0) insertPos += lastValidPos;
     if(abs(insertPos-position)>abs(forwardInsertPos-position)){
         return insertForward(position, key, value, targetSegment, forwardInsertPos);
     }else return insertBackward(position, key, value, targetSegment, insertPos);
 }
 
-void PMA::swapElements(type_t targetSegment, type_t position, type_t adjust){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t holdKey = *(segmentOffset + position);
-    *(segmentOffset + position) = *(segmentOffset + position + adjust);
-    *(segmentOffset + position + adjust) = holdKey;
+/*
+    First free slot at or after position, -1 if the rest of the segment is full
+ */
+template <typename Key, typename Value, typename Config>
+type_t PMA<Key, Value, Config>::nextFreeSlot(int targetSegment, type_t position){
+    type_t blockNo = position / JacobsonIndexSize;
+    bitmap_t freeSlots = ~bitmap[targetSegment][blockNo] & (~0ULL << (position % JacobsonIndexSize));
+    while(freeSlots == 0){
+        blockNo++;
+        if(blockNo == blocksInSegment) return -1;
+        freeSlots = ~bitmap[targetSegment][blockNo];
+    }
+    return blockNo * JacobsonIndexSize + wordFirst(freeSlots);
+}
+
+/*
+    Last free slot at or before position, -1 if the segment is full up to position
+ */
+template <typename Key, typename Value, typename Config>
+type_t PMA<Key, Value, Config>::prevFreeSlot(int targetSegment, type_t position){
+    type_t blockNo = position / JacobsonIndexSize;
+    int bitPosition = position % JacobsonIndexSize;
+    bitmap_t freeSlots = ~bitmap[targetSegment][blockNo] & (~0ULL >> (JacobsonIndexSize - 1 - bitPosition));
+    while(freeSlots == 0){
+        blockNo--;
+        if(blockNo < 0) return -1;
+        freeSlots = ~bitmap[targetSegment][blockNo];
+    }
+    return blockNo * JacobsonIndexSize + wordLast(freeSlots);
+}
+
+/*
+    Deleted slots keep their old key, so a key match only counts on an occupied slot
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::isOccupied(int targetSegment, type_t position){
+    return (bitmap[targetSegment][position / JacobsonIndexSize] >> (position % JacobsonIndexSize)) & 1;
+}
+
+/*
+    Slot of the last element of the segment (0 for an empty segment)
+ */
+template <typename Key, typename Value, typename Config>
+type_t PMA<Key, Value, Config>::lastOccupiedSlot(int targetSegment){
+    for(type_t blockNo = blocksInSegment - 1; blockNo >= 0; blockNo--){
+        if(bitmap[targetSegment][blockNo] != 0) return blockNo * JacobsonIndexSize + wordLast(bitmap[targetSegment][blockNo]);
+    }
+    return 0;
+}
 
-    segmentOffset = value_chunks[targetSegment];
-    type_t holdValue = *(segmentOffset + position);
-    *(segmentOffset + position) = *(segmentOffset + position + adjust);
-    *(segmentOffset + position + adjust) = holdValue;
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::swapElements(type_t targetSegment, type_t position, type_t adjust){
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    Key holdKey = *(segmentKeyOffset + position);
+    *(segmentKeyOffset + position) = *(segmentKeyOffset + position + adjust);
+    *(segmentKeyOffset + position + adjust) = holdKey;
+
+    Value * segmentValOffset = value_chunks[targetSegment];
+    Value holdValue = *(segmentValOffset + position);
+    *(segmentValOffset + position) = *(segmentValOffset + position + adjust);
+    *(segmentValOffset + position + adjust) = holdValue;
 }
 
-void PMA::insertInPosition(type_t position, int targetSegment, type_t key, type_t value){
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::insertInPosition(type_t position, int targetSegment, Key key, Value value){
     //Store key, value and update bitmap, cardinality and last index
-    type_t * segmentOffset = key_chunks[targetSegment];
-    *(segmentOffset + position) = key;
-    segmentOffset = value_chunks[targetSegment];
-    *(segmentOffset + position) = value;
+    *(key_chunks[targetSegment] + position) = key;
+    *(value_chunks[targetSegment] + position) = value;
     int blockPosition = position/JacobsonIndexSize;
     int bitPosition = position % JacobsonIndexSize;
-    u_short mask =  1 << bitPosition;
+    bitmap_t mask = 1ULL << bitPosition;
     bitmap[targetSegment][blockPosition] |= mask;
     cardinality[targetSegment]++;
     if(lastElementPos[targetSegment] < position) lastElementPos[targetSegment] = position;
 }
 
-bool PMA::remove(type_t key){
-    int targetSegment = searchSegment(key);
+/*
+    Merges a sorted group of keys into targetSegment. If the merged segment goes over the
+    insert threshold it is split once into as many segments as needed at split density.
+ */
+template <typename Key, typename Value, typename Config>
+size_t PMA<Key, Value, Config>::mergeIntoSegment(int targetSegment, const Key *keys, const Value *values, size_t count){
+    vector<Key> mergedKeys;
+    vector<Value> mergedValues;
+    mergedKeys.reserve(cardinality[targetSegment] + count);
+    mergedValues.reserve(cardinality[targetSegment] + count);
+
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    Value * segmentValOffset = value_chunks[targetSegment];
+    size_t r = 0;
+    for(type_t bl = 0; bl < blocksInSegment; bl++){
+        type_t pBase = bl * JacobsonIndexSize;
+        for(bitmap_t w = bitmap[targetSegment][bl]; w != 0; w &= w - 1){
+            Key curKey = *(segmentKeyOffset + pBase + wordFirst(w));
+            while(r < count && keys[r] < curKey){
+                mergedKeys.push_back(keys[r]);
+                mergedValues.push_back(values[r]);
+                r++;
+            }
+            if(r < count && keys[r] == curKey) r++;
+            mergedKeys.push_back(curKey);
+            mergedValues.push_back(*(segmentValOffset + pBase + wordFirst(w)));
+        }
+    }
+    for( ; r < count; r++){
+        mergedKeys.push_back(keys[r]);
+        mergedValues.push_back(values[r]);
+    }
+
+    size_t added = mergedKeys.size() - cardinality[targetSegment];
+    if(added == 0) return 0;
+
+    type_t total = mergedKeys.size();
+    type_t capacity = (type_t)(tree->level[0]*elementsInSegment);
+    type_t pieces = 1;
+    if(total > capacity){ //Split to the density redistributeWithDividing would leave behind
+        pieces = (2 * total + capacity - 1) / capacity;
+        redisInsCount++;
+    }
+
+    type_t perPiece = total / pieces, extra = total % pieces, offset = 0;
+    for(type_t p = 0; p < pieces; p++){
+        type_t pieceCount = perPiece + (p < extra ? 1 : 0);
+        if(p == 0){
+            layoutSegment(targetSegment, &mergedKeys[offset], &mergedValues[offset], pieceCount);
+        }else{
+            Key *new_key_chunk;
+            Value *new_value_chunk;
+            tie(new_key_chunk, new_value_chunk) = getSegment(placeNode(mergedKeys[offset]));
+            key_chunks.push_back(new_key_chunk);
+            value_chunks.push_back(new_value_chunk);
+            smallest.push_back(mergedKeys[offset]);
+            lastElementPos.push_back(0);
+            cardinality.push_back(0);
+            addBitmap(vector<bitmap_t>(blocksInSegment, 0));
+            totalSegments++;
+            layoutSegment(totalSegments-1, &mergedKeys[offset], &mergedValues[offset], pieceCount);
+            tree->insertInTree(totalSegments-1, smallest[totalSegments-1], this);
+        }
+        offset += pieceCount;
+    }
+    return added;
+}
+
+/*
+    Rewrites targetSegment with count sorted elements. Gaps follow the key distance (at most maxGap)
+    while leaving enough slots for the remaining elements.
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::layoutSegment(int targetSegment, const Key *keys, const Value *values, type_t count){
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    Value * segmentValOffset = value_chunks[targetSegment];
+    for(type_t bl = 0; bl < blocksInSegment; bl++){
+        bitmap[targetSegment][bl] = 0;
+    }
+
+    type_t position = 0;
+    for(type_t e = 0; e < count; e++){
+        if(e > 0){
+            type_t gap = min((type_t) keys[e] - (type_t) keys[e-1], (type_t) Config::maxGap);
+            type_t room = lastValidPos - position - (count - 1 - e);
+            position += max((type_t) 1, min(gap, room));
+        }
+        *(segmentKeyOffset + position) = keys[e];
+        *(segmentValOffset + position) = values[e];
+        bitmap[targetSegment][position / JacobsonIndexSize] |= 1ULL << (position % JacobsonIndexSize);
+    }
+    cardinality[targetSegment] = count;
+    lastElementPos[targetSegment] = position;
+}
+
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::remove(Key key){
+    int targetSegment = beginWrite(key);
+
+    type_t position = findLocation(key, targetSegment);
+    Key * segmentOffset = key_chunks[targetSegment];
+    Key foundKey = *(segmentOffset + position);
+    bool found = foundKey == key && isOccupied(targetSegment, position);
+    if(found) deleteInPosition(position, targetSegment, key);
+    uint64_t logged = found ? logWrite(WriteAheadLog::RecordRemove, key, NULL) : 0;
+    endWrite(targetSegment, found);
+    logCommit(logged);
+    return found;
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::deleteInPosition(type_t position, int targetSegment, Key key){
+    int blockPosition = position/JacobsonIndexSize;
+    int bitPosition = position % JacobsonIndexSize;
+    bitmap_t mask = 1ULL << bitPosition;
+    bitmap[targetSegment][blockPosition] &= (~mask);
+    cardinality[targetSegment]--;
+    if(lastElementPos[targetSegment] == position){
+        lastElementPos[targetSegment] = lastOccupiedSlot(targetSegment);
+    }
+    //Underflow is handled by endWrite
+}
+
+/*
+    Returns the slot of targetSegment to the free buffers. The segment must already be out of the tree.
+    The last segment is moved into the freed number so segment numbers stay dense
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::deleteSegment(int targetSegment){
+    chunk &c = chunks[chunkOf(key_chunks[targetSegment])];
+    c.live--;
+    freeSegmentCount++;
+    freeKeySegmentBuffer[c.node].push_back(key_chunks[targetSegment]);
+    freeValueSegmentBuffer[c.node].push_back(value_chunks[targetSegment]);
+
+    int last = totalSegments - 1;
+    if(targetSegment != last){
+        tree->renumberSegment(last, targetSegment, this);
+        key_chunks[targetSegment] = key_chunks[last];
+        value_chunks[targetSegment] = value_chunks[last];
+        smallest[targetSegment] = smallest[last];
+        lastElementPos[targetSegment] = lastElementPos[last];
+        cardinality[targetSegment] = cardinality[last];
+        if(concurrent) bitmap[targetSegment] = bitmap[last];
+        else bitmap[targetSegment].swap(bitmap[last]);
+    }
+    key_chunks.pop_back();
+    value_chunks.pop_back();
+    smallest.pop_back();
+    lastElementPos.pop_back();
+    cardinality.pop_back();
+    //Readers may still be on the words of the last segment in concurrent mode, they stay for addBitmap to reuse
+    if(!concurrent) bitmap.pop_back();
+    totalSegments--;
+}
+
+/*
+    Sets the occupancy words of the new segment numbered totalSegments. In concurrent mode the buffer left
+    behind by deleteSegment is written over instead of allocating one, so no buffer is freed under a reader
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::addBitmap(const vector<bitmap_t> &blocks){
+    if((int)bitmap.size() > totalSegments) bitmap[totalSegments] = blocks;
+    else bitmap.push_back(blocks);
+}
+
+/*
+    Spreads the elements of the neighbouring segments left and right (right follows left in key order)
+    evenly over both, or moves all of them into left when merge is set. right's bound follows its new first key
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::rebalancePair(int left, int right, bool merge){
+    type_t total = cardinality[left] + cardinality[right];
+    vector<Key> keys;
+    vector<Value> values;
+    keys.reserve(total);
+    values.reserve(total);
+    int pair[2] = {left, right};
+    for(int s = 0; s<2; s++){
+        for(type_t bl = 0; bl < blocksInSegment; bl++){
+            type_t pbase = bl * JacobsonIndexSize;
+            for(bitmap_t w = bitmap[pair[s]][bl]; w != 0; w &= w - 1){
+                keys.push_back(key_chunks[pair[s]][pbase + wordFirst(w)]);
+                values.push_back(value_chunks[pair[s]][pbase + wordFirst(w)]);
+            }
+        }
+    }
+    type_t half = merge ? total : total / 2;
+    layoutSegment(left, keys.data(), values.data(), half);
+    layoutSegment(right, keys.data() + half, values.data() + half, total - half);
+    if(!merge) smallest[right] = keys[half];
+}
+
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::lookup(Key key){
+    return get(key).has_value();
+}
+
+/*
+    Value stored for key, if any
+ */
+template <typename Key, typename Value, typename Config>
+optional<Value> PMA<Key, Value, Config>::get(Key key){
+    if(concurrent) return getConcurrent(key);
+    int targetSegment = tree->searchSegment(key);
+
+    type_t position = findLocation(key, targetSegment);
+    Key foundKey = *(key_chunks[targetSegment] + position);
+    if(foundKey != key || !isOccupied(targetSegment, position)) return nullopt;
+    return *(value_chunks[targetSegment] + position);
+}
+
+template <typename Key, typename Value, typename Config>
+type_t PMA<Key, Value, Config>::findLocation(Key key, int targetSegment){
+    if(Search_mode == 2) return findLocationBlock(key, targetSegment);
+    Key * segmentOffset = key_chunks[targetSegment];
+    type_t start = 0, end = lastElementPos[targetSegment];
+    int blockPosition, bitPosition;
+    bitmap_t mask;
+    type_t data, mid = 0;
+    while(start <= end){
+        mid = (start + end) / 2;
+        blockPosition = mid / JacobsonIndexSize;
+        bitPosition = mid % JacobsonIndexSize;
+        mask = 1ULL << bitPosition;
+        if((bitmap[targetSegment][blockPosition] & mask) == 0){
+            int64_t changedMid = mid, offset = -1;
+            while(changedMid >= start){
+                changedMid += offset;
+                blockPosition = changedMid / JacobsonIndexSize;
+                bitPosition = changedMid % JacobsonIndexSize;
+                mask = 1ULL << bitPosition;
+                if((bitmap[targetSegment][blockPosition] & mask) !=0) break;
+            }
+            if(changedMid < start){
+                changedMid = mid;
+                offset = 1;
+                while(changedMid <= end){
+                    changedMid += offset;
+                    blockPosition = changedMid / JacobsonIndexSize;
+                    bitPosition = changedMid % JacobsonIndexSize;
+                    mask = 1ULL << bitPosition;
+                    if((bitmap[targetSegment][blockPosition] & mask) !=0 ) break;
+                }
+                if(changedMid > end){
+                    return mid;
+                }else mid = changedMid;
+            }else mid = changedMid;
+        }
+        data = *(segmentOffset + mid);
+        if(data == key) return mid;
+        else if(data < key) start = mid + 1;
+        else end = mid - 1;
+    }
+    return mid;
+}
+
+/*
+    Block compare kernels for findLocationBlock. Return the mask of the SearchGroupSize lanes with
+    keys[i] <= key, the caller masks out the empty slots with the group's bits of the bitmap word.
+    There are vector kernels for 64 and 32 bit keys, a 32 bit group is a single cache line.
+ */
+template <typename Key>
+using CompareKernel = u_int (*)(const Key *keys, Key key);
+
+static_assert(SearchGroupSize == 16 && JacobsonIndexSize % SearchGroupSize == 0, "Compare kernels expect 16 slot groups");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "findLocationBlock reads the bitmap words as 16 bit groups");
+typedef u_short __attribute__((__may_alias__)) group_t;
+
+template <typename Key>
+static u_int compareBlockScalar(const Key *keys, Key key){
+    u_int lanes = 0;
+    for(int j = 0; j < SearchGroupSize; j++){
+        lanes |= (u_int)(keys[j] <= key) << j;
+    }
+    return lanes;
+}
+
+__attribute__((target("avx2")))
+static u_int compareBlockAVX2(const int64_t *keys, int64_t key){
+    __m256i keyVec = _mm256_set1_epi64x(key);
+    u_int greater = 0;
+    for(int q = 0; q < SearchGroupSize; q += 4){
+        __m256i gt = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *)(keys + q)), keyVec);
+        greater |= (u_int)_mm256_movemask_pd(_mm256_castsi256_pd(gt)) << q;
+    }
+    return ~greater & 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static u_int compareBlockAVX2(const int32_t *keys, int32_t key){
+    __m256i keyVec = _mm256_set1_epi32(key);
+    __m256i low = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)keys), keyVec);
+    __m256i high = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(keys + 8)), keyVec);
+    u_int greater = (u_int)_mm256_movemask_ps(_mm256_castsi256_ps(low)) | (u_int)_mm256_movemask_ps(_mm256_castsi256_ps(high)) << 8;
+    return ~greater & 0xFFFF;
+}
+
+__attribute__((target("avx512f")))
+static u_int compareBlockAVX512(const int64_t *keys, int64_t key){
+    __m512i keyVec = _mm512_set1_epi64(key);
+    u_int low = _mm512_cmple_epi64_mask(_mm512_loadu_si512(keys), keyVec);
+    u_int high = _mm512_cmple_epi64_mask(_mm512_loadu_si512(keys + 8), keyVec);
+    return low | (high << 8);
+}
+
+__attribute__((target("avx512f")))
+static u_int compareBlockAVX512(const int32_t *keys, int32_t key){
+    return _mm512_cmple_epi32_mask(_mm512_loadu_si512(keys), _mm512_set1_epi32(key));
+}
+
+template <typename Key>
+static CompareKernel<Key> selectCompareKernel(){
+    __builtin_cpu_init();
+    if constexpr(is_same<Key, int64_t>::value || is_same<Key, int32_t>::value){
+        if((Scan_kernel == 0 || Scan_kernel == 3) && __builtin_cpu_supports("avx512f")) return compareBlockAVX512;
+        if((Scan_kernel == 0 || Scan_kernel == 2) && __builtin_cpu_supports("avx2")) return compareBlockAVX2;
+    }
+    return compareBlockScalar<Key>;
+}
+
+template <typename Key>
+static const CompareKernel<Key> compareBlock = selectCompareKernel<Key>();
+
+/*
+    Child to follow for key in a node or leaf with count separators: the number of keys[i] <= key.
+    The separators are sorted and padded to whole SearchGroupSize groups, so each group takes one
+    compareBlock masked to the live separators. A few separators are cheaper to count inline
+ */
+template <typename Key>
+static inline int childSlot(const Key *keys, int count, Key key){
+    int child = 0;
+    if(count < NodeSearchMin){
+        for(int i = 0; i < count; i++) child += keys[i] <= key;
+        return child;
+    }
+    for(int group = 0; group < count; group += SearchGroupSize){
+        u_int lanes = compareBlock<Key>(keys + group, key);
+        if(count - group < SearchGroupSize) lanes &= (1u << (count - group)) - 1;
+        child += __builtin_popcount(lanes);
+        if(lanes != 0xFFFF) break;
+    }
+    return child;
+}
+
+/*
+    Binary search over the SearchGroupSize slot groups of the segment (by the first key of each non-empty
+    group), then one vector compare inside the chosen group masked by its bitmap bits. Returns the slot
+    holding key, or else the occupied slot next to where key belongs (its predecessor, or the first element
+    if key is the smallest).
+ */
+template <typename Key, typename Value, typename Config>
+type_t PMA<Key, Value, Config>::findLocationBlock(Key key, int targetSegment){
+    Key * segmentOffset = key_chunks[targetSegment];
+    const group_t * groups = (const group_t *) bitmap[targetSegment].data();    //16 bit groups of the (little-endian) words
+    int start = 0, end = lastElementPos[targetSegment] / SearchGroupSize, found = -1;
+
+    while(start <= end){
+        int mid = (start + end) / 2, probe = mid;
+        while(probe <= end && groups[probe] == 0) probe++;
+        if(probe > end){
+            end = mid - 1;
+            continue;
+        }
+        if(*(segmentOffset + probe * SearchGroupSize + __builtin_ctz(groups[probe])) <= key){
+            found = probe;
+            start = probe + 1;
+        }else end = mid - 1;
+    }
+
+    if(UNLIKELY(found < 0)){ //Key is smaller than every element of the segment
+        for(int group = 0; group <= lastElementPos[targetSegment] / SearchGroupSize; group++){
+            if(groups[group] != 0) return group * SearchGroupSize + __builtin_ctz(groups[group]);
+        }
+        return 0;
+    }
+    u_int lanes = compareBlock<Key>(segmentOffset + found * SearchGroupSize, key) & groups[found];
+    return found * SearchGroupSize + 31 - __builtin_clz(lanes);
+}
+
+//Prefetches the cache lines of bytes starting at p
+static inline void prefetchLines(const void *p, size_t bytes){
+    for(size_t line = 0; line < bytes; line += 64) __builtin_prefetch((const char *)p + line);
+}
+
+/*
+    Looks up n keys at once. The keys go through in groups of LookupBatchGroup, one step at a time for the
+    whole group: each tree level (all leaves are at the same depth), the leaf, the segment tables, the
+    occupancy words and keys, and the value slot. Every step prefetches what the next one reads for all
+    keys of the group, so their cache misses overlap instead of forming one dependent chain per key.
+    found[i] tells whether keys[i] is present, outValues[i] then holds its value. Returns the number found
+ */
+template <typename Key, typename Value, typename Config>
+size_t PMA<Key, Value, Config>::lookup_batch(const Key *keys, size_t n, Value *outValues, bool *found){
+    size_t hits = 0;
+    if(concurrent){
+        for(size_t i = 0; i<n; i++){
+            optional<Value> value = getConcurrent(keys[i]);
+            found[i] = value.has_value();
+            if(found[i]){
+                outValues[i] = *value;
+                hits++;
+            }
+        }
+        return hits;
+    }
+
+    typedef typename tree_t::node node;
+    typedef typename tree_t::leaf leaf;
+    void *at[LookupBatchGroup];
+    int segment[LookupBatchGroup];
+    type_t position[LookupBatchGroup];
+    for(size_t base = 0; base < n; base += LookupBatchGroup){
+        int count = min((size_t)LookupBatchGroup, n - base);
+        const Key *probe = keys + base;
+
+        bool lastLevel = false;
+        for(int i = 0; i<count; i++) at[i] = tree->root;
+        while(!lastLevel){
+            lastLevel = ((node *)at[0])->nodeLeaf;
+            for(int i = 0; i<count; i++){
+                node *nd = (node *)at[i];
+                at[i] = nd->child_ptr[childSlot(nd->key, nd->ptrCount - 1, probe[i])];
+                prefetchLines(at[i], lastLevel ? sizeof(leaf) : sizeof(node));
+            }
+        }
+        for(int i = 0; i<count; i++){
+            leaf *l = (leaf *)at[i];
+            segment[i] = l->segNo[childSlot(l->key, l->childCount - 1, probe[i])];
+            __builtin_prefetch(&bitmap[segment[i]]);
+            __builtin_prefetch(&key_chunks[segment[i]]);
+            __builtin_prefetch(&value_chunks[segment[i]]);
+            __builtin_prefetch(&lastElementPos[segment[i]]);
+        }
+        //The block search probes the middle of the used slots first, then a quarter either side
+        for(int i = 0; i<count; i++){
+            prefetchLines(bitmap[segment[i]].data(), blocksInSegment * sizeof(bitmap_t));
+            const Key *segmentKeys = key_chunks[segment[i]];
+            type_t used = lastElementPos[segment[i]] + 1;
+            for(int q = 1; q < 4; q++) __builtin_prefetch(segmentKeys + used * q / 4);
+        }
+        for(int i = 0; i<count; i++){
+            position[i] = findLocation(probe[i], segment[i]);
+            found[base + i] = key_chunks[segment[i]][position[i]] == probe[i] && isOccupied(segment[i], position[i]);
+            if(found[base + i]) __builtin_prefetch(value_chunks[segment[i]] + position[i]);
+        }
+        for(int i = 0; i<count; i++){
+            if(!found[base + i]) continue;
+            outValues[base + i] = value_chunks[segment[i]][position[i]];
+            hits++;
+        }
+    }
+    return hits;
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::printAllElements(){
+    tree->printAllElements(this);
+}
+
+/*
+    Block scan kernels for range_sum. Each one sums the occupied slots of a run of blocks, using the
+    block's occupancy word directly as the lane mask, and stops at the first block whose last key is
+    past endKey (taking back the keys > endKey of that block). Returns true when the range ended.
+    Vector kernels cover 64 bit keys with 64 bit values and 32 bit keys with 32 or 64 bit values (widened
+    to 64 bit sums). Values that are not numbers (Payload) are not summed.
+ */
+template <typename Key, typename Value>
+using ScanKernel = bool (*)(const Key *keys, const Value *values, const bitmap_t *bits, type_t blocks,
+                            Key endKey, type_t &sumKey, type_t &sumValue);
+
+static_assert(JacobsonIndexSize == 64, "Scan kernels expect 64 slots per block");
+
+template <typename Value>
+static inline type_t valueOf(const Value &value){
+    if constexpr(is_arithmetic<Value>::value) return (type_t) value;
+    else return 0;
+}
+
+template <typename Key, typename Value>
+static inline bool trimBlock(const Key *keys, const Value *values, bitmap_t mask, Key endKey, type_t &sumKey, type_t &sumValue){
+    int last = wordLast(mask);
+    if(LIKELY(keys[last] <= endKey)) return false;
+    while(mask != 0){
+        last = wordLast(mask);
+        if(keys[last] <= endKey) break;
+        sumKey -= keys[last];
+        sumValue -= valueOf(values[last]);
+        mask &= ~(1ULL << last);
+    }
+    return true;
+}
+
+template <typename Key, typename Value>
+static bool scanBlocksScalar(const Key *keys, const Value *values, const bitmap_t *bits, type_t blocks,
+                             Key endKey, type_t &sumKey, type_t &sumValue){
+    for(type_t b = 0; b < blocks; b++, keys += JacobsonIndexSize, values += JacobsonIndexSize){
+        bitmap_t mask = bits[b];
+        if(mask == 0) continue;
+        if(mask == ~0ULL){
+            for(int j = 0; j < JacobsonIndexSize; j++){
+                sumKey += keys[j];
+                sumValue += valueOf(values[j]);
+            }
+        }else{
+            for(bitmap_t m = mask; m != 0; m &= m - 1){
+                int j = wordFirst(m);
+                sumKey += keys[j];
+                sumValue += valueOf(values[j]);
+            }
+        }
+        if(trimBlock(keys, values, mask, endKey, sumKey, sumValue)) return true;
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+static bool scanBlocksAVX2(const int64_t *keys, const int64_t *values, const bitmap_t *bits, type_t blocks,
+                           int64_t endKey, type_t &sumKey, type_t &sumValue){
+    const __m256i laneBits = _mm256_set_epi64x(8, 4, 2, 1);
+    __m256i accKey = _mm256_setzero_si256(), accValue = _mm256_setzero_si256();
+    bool ended = false;
+    for(type_t b = 0; b < blocks; b++, keys += JacobsonIndexSize, values += JacobsonIndexSize){
+        bitmap_t mask = bits[b];
+        if(mask == 0) continue;
+        for(int g = 0; g < JacobsonIndexSize; g += 16){
+            u_int group = (mask >> g) & 0xFFFF;
+            if(group == 0) continue;
+            if(group == 0xFFFF){
+                for(int q = g; q < g + 16; q += 4){
+                    accKey = _mm256_add_epi64(accKey, _mm256_loadu_si256((const __m256i *)(keys + q)));
+                    accValue = _mm256_add_epi64(accValue, _mm256_loadu_si256((const __m256i *)(values + q)));
+                }
+            }else{
+                for(int q = 0; q < 16; q += 4){
+                    __m256i nibble = _mm256_set1_epi64x((group >> q) & 0xF);
+                    __m256i lanes = _mm256_cmpeq_epi64(_mm256_and_si256(nibble, laneBits), laneBits);
+                    accKey = _mm256_add_epi64(accKey, _mm256_and_si256(lanes, _mm256_loadu_si256((const __m256i *)(keys + g + q))));
+                    accValue = _mm256_add_epi64(accValue, _mm256_and_si256(lanes, _mm256_loadu_si256((const __m256i *)(values + g + q))));
+                }
+            }
+        }
+        if(trimBlock(keys, values, mask, endKey, sumKey, sumValue)){
+            ended = true;
+            break;
+        }
+    }
+    type_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, accKey);
+    sumKey += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, accValue);
+    sumValue += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return ended;
+}
+
+//Adds the 32 bit lanes of v to the 64 bit lanes of acc
+__attribute__((target("avx2")))
+static inline __m256i addWidenedAVX2(__m256i acc, __m256i v){
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    return _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+}
+
+//Values of the 8 slots selected by the 32 bit lane mask of a 32 bit key group
+__attribute__((target("avx2")))
+static inline __m256i addValuesAVX2(__m256i acc, const int32_t *values, __m256i lanes){
+    return addWidenedAVX2(acc, _mm256_and_si256(lanes, _mm256_loadu_si256((const __m256i *)values)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i addValuesAVX2(__m256i acc, const int64_t *values, __m256i lanes){
+    __m256i low = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(lanes));
+    __m256i high = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(lanes, 1));
+    acc = _mm256_add_epi64(acc, _mm256_and_si256(low, _mm256_loadu_si256((const __m256i *)values)));
+    return _mm256_add_epi64(acc, _mm256_and_si256(high, _mm256_loadu_si256((const __m256i *)(values + 4))));
+}
+
+template <typename Value>
+__attribute__((target("avx2")))
+static bool scanBlocksAVX2(const int32_t *keys, const Value *values, const bitmap_t *bits, type_t blocks,
+                           int32_t endKey, type_t &sumKey, type_t &sumValue){
+    const __m256i laneBits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    __m256i accKey = _mm256_setzero_si256(), accValue = _mm256_setzero_si256();
+    bool ended = false;
+    for(type_t b = 0; b < blocks; b++, keys += JacobsonIndexSize, values += JacobsonIndexSize){
+        bitmap_t mask = bits[b];
+        if(mask == 0) continue;
+        for(int q = 0; q < JacobsonIndexSize; q += 8){
+            u_int group = (mask >> q) & 0xFF;
+            if(group == 0) continue;
+            __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(group), laneBits), laneBits);
+            accKey = addWidenedAVX2(accKey, _mm256_and_si256(lanes, _mm256_loadu_si256((const __m256i *)(keys + q))));
+            if constexpr(is_arithmetic<Value>::value) accValue = addValuesAVX2(accValue, values + q, lanes);
+        }
+        if(trimBlock(keys, values, mask, endKey, sumKey, sumValue)){
+            ended = true;
+            break;
+        }
+    }
+    type_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, accKey);
+    sumKey += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, accValue);
+    sumValue += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return ended;
+}
+
+__attribute__((target("avx512f")))
+static bool scanBlocksAVX512(const int64_t *keys, const int64_t *values, const bitmap_t *bits, type_t blocks,
+                             int64_t endKey, type_t &sumKey, type_t &sumValue){
+    __m512i accKey = _mm512_setzero_si512(), accValue = _mm512_setzero_si512();
+    bool ended = false;
+    for(type_t b = 0; b < blocks; b++, keys += JacobsonIndexSize, values += JacobsonIndexSize){
+        bitmap_t mask = bits[b];
+        if(mask == 0) continue;
+        if(mask == ~0ULL){
+            for(int q = 0; q < JacobsonIndexSize; q += 8){
+                accKey = _mm512_add_epi64(accKey, _mm512_loadu_si512(keys + q));
+                accValue = _mm512_add_epi64(accValue, _mm512_loadu_si512(values + q));
+            }
+        }else{
+            for(int q = 0; q < JacobsonIndexSize; q += 8){
+                __mmask8 lanes = (mask >> q) & 0xFF;
+                accKey = _mm512_add_epi64(accKey, _mm512_maskz_loadu_epi64(lanes, keys + q));
+                accValue = _mm512_add_epi64(accValue, _mm512_maskz_loadu_epi64(lanes, values + q));
+            }
+        }
+        if(trimBlock(keys, values, mask, endKey, sumKey, sumValue)){
+            ended = true;
+            break;
+        }
+    }
+    type_t lanes[8];
+    _mm512_storeu_si512(lanes, accKey);
+    for(int j = 0; j < 8; j++) sumKey += lanes[j];
+    _mm512_storeu_si512(lanes, accValue);
+    for(int j = 0; j < 8; j++) sumValue += lanes[j];
+    return ended;
+}
+
+//Adds the 16 values at p selected by lanes, widened to 64 bit, to acc
+__attribute__((target("avx512f")))
+static inline __m512i addWidenedAVX512(__m512i acc, const int32_t *p, __mmask16 lanes){
+    acc = _mm512_add_epi64(acc, _mm512_maskz_cvtepi32_epi64(lanes & 0xFF, _mm256_loadu_si256((const __m256i *)p)));
+    return _mm512_add_epi64(acc, _mm512_maskz_cvtepi32_epi64(lanes >> 8, _mm256_loadu_si256((const __m256i *)(p + 8))));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i addValuesAVX512(__m512i acc, const int32_t *values, __mmask16 lanes){
+    return addWidenedAVX512(acc, values, lanes);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i addValuesAVX512(__m512i acc, const int64_t *values, __mmask16 lanes){
+    acc = _mm512_add_epi64(acc, _mm512_maskz_loadu_epi64(lanes & 0xFF, values));
+    return _mm512_add_epi64(acc, _mm512_maskz_loadu_epi64(lanes >> 8, values + 8));
+}
+
+template <typename Value>
+__attribute__((target("avx512f")))
+static bool scanBlocksAVX512(const int32_t *keys, const Value *values, const bitmap_t *bits, type_t blocks,
+                             int32_t endKey, type_t &sumKey, type_t &sumValue){
+    __m512i accKey = _mm512_setzero_si512(), accValue = _mm512_setzero_si512();
+    bool ended = false;
+    for(type_t b = 0; b < blocks; b++, keys += JacobsonIndexSize, values += JacobsonIndexSize){
+        bitmap_t mask = bits[b];
+        if(mask == 0) continue;
+        for(int q = 0; q < JacobsonIndexSize; q += 16){
+            __mmask16 lanes = (mask >> q) & 0xFFFF;
+            if(lanes == 0) continue;
+            accKey = addWidenedAVX512(accKey, keys + q, lanes);
+            if constexpr(is_arithmetic<Value>::value) accValue = addValuesAVX512(accValue, values + q, lanes);
+        }
+        if(trimBlock(keys, values, mask, endKey, sumKey, sumValue)){
+            ended = true;
+            break;
+        }
+    }
+    type_t lanes[8];
+    _mm512_storeu_si512(lanes, accKey);
+    for(int j = 0; j < 8; j++) sumKey += lanes[j];
+    _mm512_storeu_si512(lanes, accValue);
+    for(int j = 0; j < 8; j++) sumValue += lanes[j];
+    return ended;
+}
+
+template <typename Key, typename Value>
+static ScanKernel<Key, Value> selectScanKernel(){
+    __builtin_cpu_init();
+    constexpr bool vectorValues = is_same<Value, int64_t>::value || is_same<Value, int32_t>::value || !is_arithmetic<Value>::value;
+    if constexpr((is_same<Key, int64_t>::value && is_same<Value, int64_t>::value) || (is_same<Key, int32_t>::value && vectorValues)){
+        if((Scan_kernel == 0 || Scan_kernel == 3) && __builtin_cpu_supports("avx512f")) return scanBlocksAVX512;
+        if((Scan_kernel == 0 || Scan_kernel == 2) && __builtin_cpu_supports("avx2")) return scanBlocksAVX2;
+    }
+    return scanBlocksScalar<Key, Value>;
+}
+
+template <typename Key, typename Value>
+static const ScanKernel<Key, Value> scanBlocks = selectScanKernel<Key, Value>();
+
+//Allocation_type 3 read-ahead. Advice is given for whole pages, so a segment also covers its neighbours on the page
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::adviseSegment(int targetSegment, int advice){
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t keys = (uintptr_t)key_chunks[targetSegment], values = (uintptr_t)value_chunks[targetSegment];
+    madvise((void *)(keys & ~(page - 1)), keys + elementsInSegment * sizeof(Key) - (keys & ~(page - 1)), advice);
+    madvise((void *)(values & ~(page - 1)), values + elementsInSegment * sizeof(Value) - (values & ~(page - 1)), advice);
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::adviseLeaf(typename tree_t::leaf *l, int advice){
+    for(int i = 0; i<l->childCount; i++) adviseSegment(l->segNo[i], advice);
+}
+
+/*
+    Called when a scan enters leaf l, ahead is what the last call returned (NULL for the first leaf).
+    Keeps the segments of the next ScanAdviseAhead leaves being read in. A no-op unless Allocation_type is 3
+ */
+template <typename Key, typename Value, typename Config>
+typename PMA<Key, Value, Config>::tree_t::leaf *PMA<Key, Value, Config>::adviseAhead(typename tree_t::leaf *ahead, typename tree_t::leaf *l){
+    if(Allocation_type != 3) return ahead;
+    if(ahead == NULL){
+        ahead = l;
+        adviseLeaf(ahead, MADV_WILLNEED);
+        for(int i = 0; i<ScanAdviseAhead && ahead->nextLeaf != NULL; i++){
+            ahead = ahead->nextLeaf;
+            adviseLeaf(ahead, MADV_WILLNEED);
+        }
+    }else if(ahead->nextLeaf != NULL){
+        ahead = ahead->nextLeaf;
+        adviseLeaf(ahead, MADV_WILLNEED);
+    }
+    return ahead;
+}
+
+//Sets the access pattern of all file-backed chunks, MADV_SEQUENTIAL for long scans and MADV_NORMAL after them
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::adviseChunks(int advice){
+    for(u_int c = 0; c<chunks.size(); c++){
+        if(chunks[c].fileOffset < 0) continue;
+        madvise(chunks[c].keys, Config::chunkSize, advice);
+        madvise(chunks[c].values, Config::chunkSize / sizeof(Key) * sizeof(Value), advice);
+    }
+}
+
+/*
+    Sums the keys and values in [startKey, endKey]. Segment numbers say nothing about key order, so the
+    segments are taken from the leaf chain, and the next one is prefetched while one is summed
+ */
+template <typename Key, typename Value, typename Config>
+tuple<type_t, type_t> PMA<Key, Value, Config>::range_sum(Key startKey, Key endKey){
+    if(concurrent) return rangeSumConcurrent(startKey, endKey);
+    typename tree_t::leaf *l = tree->findLeaf(startKey);
+    int child = childSlot(l->key, l->childCount - 1, startKey);
+    int targetSegment = l->segNo[child];
+
+    type_t position = findLocation(startKey, targetSegment);
+    type_t sum_key = 0, sum_value = 0;
+    typename tree_t::leaf *ahead = adviseAhead(NULL, l);
+    int leaves = 0, here = numaPolicy != NumaFirstTouch ? currentNode() : 0;
+    uint64_t local = 0, remote = 0;
+    while(true){
+        if(numaPolicy != NumaFirstTouch) (segmentNode(targetSegment) == here ? local : remote)++;
+        if(++child == l->childCount){
+            l = l->nextLeaf;
+            child = 0;
+            if(l != NULL) ahead = adviseAhead(ahead, l);
+            if(Allocation_type == 3 && ++leaves == ScanSequentialLeaves) adviseChunks(MADV_SEQUENTIAL);
+        }
+        if(l != NULL) prefetchSegment(l->segNo[child]);
+        if(sumSegment(targetSegment, position, startKey, endKey, sum_key, sum_value) || l == NULL) break;
+        targetSegment = l->segNo[child];
+        position = 0;
+    }
+    if(Allocation_type == 3 && leaves >= ScanSequentialLeaves) adviseChunks(MADV_NORMAL);
+    localAccesses += local;
+    remoteAccesses += remote;
+    return {sum_key, sum_value};
+}
+
+/*
+    Pulls the occupancy words and the used part of the keys (and of arithmetic values, the only ones
+    range_sum reads) of targetSegment toward the cache
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::prefetchSegment(int targetSegment){
+    __builtin_prefetch(bitmap[targetSegment].data());
+    size_t used = lastElementPos[targetSegment] + 1;
+    const char *keys = (const char *)key_chunks[targetSegment];
+    for(size_t line = 0; line < used * sizeof(Key); line += 64) __builtin_prefetch(keys + line);
+    if constexpr(is_arithmetic<Value>::value){
+        const char *values = (const char *)value_chunks[targetSegment];
+        for(size_t line = 0; line < used * sizeof(Value); line += 64) __builtin_prefetch(values + line);
+    }
+}
+
+/*
+    Adds the elements of targetSegment from position on that are within [startKey, endKey] to the sums.
+    Returns true once a key past endKey is seen
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::sumSegment(int targetSegment, type_t position, Key startKey, Key endKey, type_t &sum_key, type_t &sum_value){
+    type_t blockNo = position/JacobsonIndexSize;
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    Value * segmentValOffset = value_chunks[targetSegment];
+    type_t pbase = blockNo * JacobsonIndexSize;
+
+    //Range starts somewhere within this block, at or after position
+    if(position != pbase || *(segmentKeyOffset + position) < startKey){
+        for(bitmap_t w = bitmap[targetSegment][blockNo] & (~0ULL << (position % JacobsonIndexSize)); w != 0; w &= w - 1){
+            Key key = *(segmentKeyOffset+pbase+wordFirst(w));
+            if(key > endKey) return true;
+            if(key >= startKey) {
+                sum_key += key;
+                sum_value += valueOf(*(segmentValOffset+pbase+wordFirst(w)));
+            }
+        }
+        blockNo++;
+    }
+
+    //Rest of the segment is summed a run of blocks at a time by the selected kernel
+    return scanBlocks<Key, Value>(segmentKeyOffset + blockNo * JacobsonIndexSize, segmentValOffset + blockNo * JacobsonIndexSize,
+                      bitmap[targetSegment].data() + blockNo, blocksInSegment - blockNo, endKey, sum_key, sum_value);
+}
+
+/*
+    range_sum over threads workers. The covered segments are cut into pieces of about equal
+    element count (see partitionSegments), each piece is summed by one thread and the sums are added up
+ */
+template <typename Key, typename Value, typename Config>
+tuple<type_t, type_t> PMA<Key, Value, Config>::range_sum_parallel(Key startKey, Key endKey, int threads){
+    if(concurrent) return rangeSumParallelConcurrent(startKey, endKey, threads);
+    vector<int> segments;
+    vector<size_t> cuts;
+    partitionSegments(startKey, endKey, max(threads, 1), segments, cuts);
+    vector<tuple<type_t, type_t>> partial(cuts.size(), make_tuple(0, 0));
+
+    //With NumaKeyRange every piece is scanned by a worker running on the node of its first segment
+    bool pinned = numaPolicy == NumaKeyRange && freeKeySegmentBuffer.size() > 1;
+    auto scan = [&](size_t piece){
+        size_t to = (piece + 1 < cuts.size()) ? cuts[piece + 1] : segments.size();
+        type_t sum_key = 0, sum_value = 0;
+        size_t advised = cuts[piece];
+        if(pinned && cuts[piece] < to) runOnNode(segmentNode(segments[cuts[piece]]));
+        int here = numaPolicy != NumaFirstTouch ? currentNode() : 0;
+        uint64_t local = 0, remote = 0;
+        for(size_t i = cuts[piece]; i<to; i++){
+            if(numaPolicy != NumaFirstTouch) (segmentNode(segments[i]) == here ? local : remote)++;
+            for(; Allocation_type == 3 && advised < min(to, i + ScanAdviseAhead * Config::leafDegree); advised++) adviseSegment(segments[advised], MADV_WILLNEED);
+            if(i + 1 < to) prefetchSegment(segments[i+1]);
+            type_t position = (i == 0) ? findLocation(startKey, segments[0]) : 0;
+            if(sumSegment(segments[i], position, startKey, endKey, sum_key, sum_value)) break;
+        }
+        partial[piece] = make_tuple(sum_key, sum_value);
+        localAccesses += local;
+        remoteAccesses += remote;
+    };
+    vector<thread> workers;
+    for(size_t piece = pinned ? 0 : 1; piece < cuts.size(); piece++) workers.push_back(thread(scan, piece));
+    if(!pinned) scan(0);
+    for(u_int i = 0; i<workers.size(); i++) workers[i].join();
+
+    type_t sum_key = 0, sum_value = 0;
+    for(u_int i = 0; i<partial.size(); i++){
+        sum_key += std::get<0>(partial[i]);
+        sum_value += std::get<1>(partial[i]);
+    }
+    return {sum_key, sum_value};
+}
+
+/*
+    Splits [startKey, endKey] into at most pieces disjoint sub-ranges holding about the same number
+    of elements, in key order. Boundaries fall on segment boundaries, so fewer pieces come back
+    when the range covers only a few segments
+ */
+template <typename Key, typename Value, typename Config>
+vector<tuple<Key, Key>> PMA<Key, Value, Config>::partition_range(Key startKey, Key endKey, int pieces){
+    vector<Key> bounds;
+    if(concurrent) partitionConcurrent(startKey, endKey, max(pieces, 1), bounds);
+    else{
+        vector<int> segments;
+        vector<size_t> cuts;
+        partitionSegments(startKey, endKey, max(pieces, 1), segments, cuts);
+        for(size_t i = 1; i<cuts.size(); i++){
+            Key boundary = endKey;
+            lowestKey(segments[cuts[i]], boundary);
+            bounds.push_back(boundary);
+        }
+    }
+    vector<tuple<Key, Key>> ranges;
+    Key from = startKey;
+    for(size_t i = 0; i<bounds.size(); i++){
+        ranges.push_back(make_tuple(from, bounds[i] - 1));
+        from = bounds[i];
+    }
+    ranges.push_back(make_tuple(from, endKey));
+    return ranges;
+}
+
+/*
+    Smallest key in targetSegment. Returns false if the segment is empty
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::lowestKey(int targetSegment, Key &key){
+    for(type_t blockNo = 0; blockNo < blocksInSegment; blockNo++){
+        bitmap_t w = bitmap[targetSegment][blockNo];
+        if(w != 0){
+            key = key_chunks[targetSegment][blockNo * JacobsonIndexSize + wordFirst(w)];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Segments that may hold keys of [startKey, endKey], in key order, following the leaf chain
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::coveredSegments(Key startKey, Key endKey, vector<int> &segments){
+    typename tree_t::leaf *l = tree->findLeaf(startKey);
+    int child = childSlot(l->key, l->childCount - 1, startKey);
+    segments.push_back(l->segNo[child++]);
+    for( ; l != NULL; l = l->nextLeaf, child = 0){
+        for( ; child < l->childCount; child++){
+            Key lowest;
+            if(child > 0 && l->key[child-1] > endKey) return;
+            if(child == 0 && lowestKey(l->segNo[0], lowest) && lowest > endKey) return;
+            segments.push_back(l->segNo[child]);
+        }
+    }
+}
+
+/*
+    Lists the covered segments and picks where each piece starts (cuts, indexes into segments).
+    A piece ends once it holds its share of the total cardinality; cuts are only placed
+    on non-empty segments whose smallest key lies inside the range
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::partitionSegments(Key startKey, Key endKey, int pieces, vector<int> &segments, vector<size_t> &cuts){
+    coveredSegments(startKey, endKey, segments);
+    type_t total = 0;
+    for(u_int i = 0; i<segments.size(); i++) total += cardinality[segments[i]];
+
+    cuts.push_back(0);
+    type_t seen = 0;
+    for(size_t i = 0; i + 1 < segments.size() && (int)cuts.size() < pieces; i++){
+        seen += cardinality[segments[i]];
+        Key lowest;
+        if(seen * pieces < total * (type_t)cuts.size()) continue;
+        if(!lowestKey(segments[i+1], lowest) || lowest <= startKey || lowest > endKey) continue;
+        cuts.push_back(i + 1);
+    }
+}
+
+/*
+    partitionSegments for concurrent mode. Only the leaf chain is read, under the tree version: a piece
+    starts at the separator in front of a segment, so no cut falls on the first segment of a leaf.
+    Cardinalities are read without the segment versions, a stale one only makes the pieces less even
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::partitionConcurrent(Key startKey, Key endKey, int pieces, vector<Key> &bounds){
+    vector<tuple<Key, type_t, bool>> covered;      //Lower bound, cardinality and whether the bound is a separator
+    while(true){
+        uint64_t treeSeen = readVersion(treeVersion);
+        if(UNLIKELY(treeSeen & 1)){
+            _mm_pause();
+            continue;
+        }
+        covered.clear();
+        bool torn = false;
+        typename tree_t::leaf *l = tree->findLeaf(startKey);
+        int child = childSlot(l->key, l->childCount - 1, startKey);
+        for(bool first = true; l != NULL && !torn; l = l->nextLeaf, child = 0){
+            for( ; child < l->childCount; child++, first = false){
+                int targetSegment = l->segNo[child];
+                if(UNLIKELY(targetSegment < 0 || targetSegment >= totalSegments)){
+                    torn = true;
+                    break;
+                }
+                bool separated = !first && child > 0;
+                if(separated && l->key[child-1] > endKey) break;
+                covered.push_back(make_tuple(separated ? l->key[child-1] : startKey, (type_t)cardinality[targetSegment], separated));
+            }
+            if(child < l->childCount) break;
+        }
+        if(!torn && validateVersion(treeVersion, treeSeen)) break;
+    }
+
+    type_t total = 0, seen = 0;
+    for(u_int i = 0; i<covered.size(); i++) total += std::get<1>(covered[i]);
+    bounds.clear();
+    for(size_t i = 0; i + 1 < covered.size() && (int)bounds.size() + 1 < pieces; i++){
+        seen += std::get<1>(covered[i]);
+        if(seen * pieces < total * (type_t)(bounds.size() + 1)) continue;
+        Key lowest = std::get<0>(covered[i+1]);
+        if(!std::get<2>(covered[i+1]) || lowest <= startKey || (!bounds.empty() && lowest <= bounds.back())) continue;
+        bounds.push_back(lowest);
+    }
+}
+
+/*
+    range_sum_parallel for concurrent mode. The pieces of partition_range are only key bounds, each
+    one is summed by rangeSumConcurrent, so a piece retries alone when a writer changes its segments
+ */
+template <typename Key, typename Value, typename Config>
+tuple<type_t, type_t> PMA<Key, Value, Config>::rangeSumParallelConcurrent(Key startKey, Key endKey, int threads){
+    vector<tuple<Key, Key>> ranges = partition_range(startKey, endKey, threads);
+    vector<tuple<type_t, type_t>> partial(ranges.size(), make_tuple(0, 0));
+    auto scan = [&](size_t piece){
+        partial[piece] = rangeSumConcurrent(std::get<0>(ranges[piece]), std::get<1>(ranges[piece]));
+    };
+    vector<thread> workers;
+    for(size_t piece = 1; piece < ranges.size(); piece++) workers.push_back(thread(scan, piece));
+    scan(0);
+    for(u_int i = 0; i<workers.size(); i++) workers[i].join();
+
+    type_t sum_key = 0, sum_value = 0;
+    for(u_int i = 0; i<partial.size(); i++){
+        sum_key += std::get<0>(partial[i]);
+        sum_value += std::get<1>(partial[i]);
+    }
+    return {sum_key, sum_value};
+}
+
+/*
+    Returns a cursor on the first element with key >= key (invalid if there is none)
+ */
+template <typename Key, typename Value, typename Config>
+typename PMA<Key, Value, Config>::Cursor PMA<Key, Value, Config>::seek(Key key){
+    Cursor c;
+    c.pma = this;
+    c.l = tree->findLeaf(key);
+    c.ahead = adviseAhead(NULL, c.l);
+    c.child = childSlot(c.l->key, c.l->childCount - 1, key);
+    c.segNo = c.l->segNo[c.child];
+    type_t position = findLocation(key, c.segNo);
+    c.block = position / JacobsonIndexSize;
+    c.rest = bitmap[c.segNo][c.block] & (~0ULL << (position % JacobsonIndexSize));
+    while(c.settle() && *c.key() < key) c.rest &= c.rest - 1;
+    return c;
+}
+
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::Cursor::next(){
+    rest &= rest - 1;
+    return settle();
+}
+
+/*
+    Hands out the remaining occupied slots of the current block and moves to the next block
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::Cursor::nextSpan(span &s){
+    if(l == NULL) return false;
+    s.keys = keyBase;
+    s.values = valueBase;
+    s.bits = rest;
+    rest = 0;
+    settle();
+    return true;
+}
+
+/*
+    Moves forward to the first occupied slot at or after the current one, crossing
+    blocks, segments and leaves as needed
+ */
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::Cursor::settle(){
+    while(l != NULL){
+        if(rest != 0){
+            keyBase = pma->key_chunks[segNo] + block * JacobsonIndexSize;
+            valueBase = pma->value_chunks[segNo] + block * JacobsonIndexSize;
+            return true;
+        }
+        block++;
+        if(block == pma->blocksInSegment || block * JacobsonIndexSize > pma->lastElementPos[segNo]){
+            child++;
+            if(child == l->childCount){
+                l = l->nextLeaf;
+                child = 0;
+                if(l == NULL) return false;
+                ahead = pma->adviseAhead(ahead, l);
+            }
+            segNo = l->segNo[child];
+            block = 0;
+        }
+        rest = pma->bitmap[segNo][block];
+    }
+    return false;
+}
+
+/*
+    Switches the PMA to concurrent mode, after which insert, remove, lookup, range_sum, range_sum_parallel
+    and partition_range may be called from several threads. Writers lock only the segment they change, a
+    split or merge also takes layoutLock and, just while it changes tree nodes, the tree lock. Readers never
+    lock, they validate the versions they read and retry. The segment tables are reserved for maxSegments so they are never moved under a reader.
+    insert_batch, bulk_load and cursors stay single-threaded
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::enableConcurrency(int maxSegments){
+    if(concurrent) return;
+    if(maxSegments < totalSegments){
+        cout<<"Cannot enable concurrency with "<<maxSegments<<" segments, "<<totalSegments<<" are in use"<<endl;
+        exit(0);
+    }
+    this->maxSegments = maxSegments;
+    key_chunks.reserve(maxSegments);
+    value_chunks.reserve(maxSegments);
+    smallest.reserve(maxSegments);
+    lastElementPos.reserve(maxSegments);
+    cardinality.reserve(maxSegments);
+    bitmap.reserve(maxSegments);
+    segmentVersion = new atomic<uint64_t>[maxSegments];
+    for(int i = 0; i<maxSegments; i++) segmentVersion[i].store(0, memory_order_relaxed);
+    tree->deferFree = true;
+    concurrent = true;
+}
+
+/*
+    Back to single-threaded mode. Must be called once all threads are done
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::disableConcurrency(){
+    if(!concurrent) return;
+    if(shrinker.joinable()) shrinker.join();
+    concurrent = false;
+    tree->deferFree = false;
+    tree->releaseRetired();
+    bitmap.resize(totalSegments);
+    for(u_int i = 0; i<retiredChunks.size(); i++) releaseChunk(retiredChunks[i]);
+    retiredChunks.clear();
+    delete[] segmentVersion;
+    segmentVersion = NULL;
+}
+
+//Snapshot of the version for an optimistic read. It is odd while a writer holds it, the reader then retries
+template <typename Key, typename Value, typename Config>
+uint64_t PMA<Key, Value, Config>::readVersion(atomic<uint64_t> &version){
+    return version.load(memory_order_acquire);
+}
+
+//True if no writer held the version when it was read and nothing was written under it since
+template <typename Key, typename Value, typename Config>
+bool PMA<Key, Value, Config>::validateVersion(atomic<uint64_t> &version, uint64_t seen){
+    atomic_thread_fence(memory_order_acquire);
+    return !(seen & 1) && version.load(memory_order_relaxed) == seen;
+}
+
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::lockVersion(atomic<uint64_t> &version){
+    while(true){
+        uint64_t seen = version.load(memory_order_relaxed);
+        if(!(seen & 1) && version.compare_exchange_weak(seen, seen + 1, memory_order_acquire)) return;
+        _mm_pause();
+    }
+}
 
-    type_t position = findLocation(key, targetSegment);
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t foundKey = *(segmentOffset + position);
-    if(foundKey != key) return false;
-    deleteInPosition(position, targetSegment, key);
-    return true;
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::unlockVersion(atomic<uint64_t> &version){
+    version.fetch_add(1, memory_order_release);
 }
 
-void PMA::deleteInPosition(type_t position, int targetSegment, type_t key){
-    int blockPosition = position/JacobsonIndexSize;
-    int bitPosition = position % JacobsonIndexSize;
-    u_short mask =  1 << bitPosition;
-    bitmap[targetSegment][blockPosition] &= (~mask);
-    cardinality[targetSegment]--;
-    if(lastElementPos[targetSegment] == position){
-        u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-        lastElementPos[targetSegment] = blockPosition * JacobsonIndexSize + ar[ar[0]];
+/*
+    Locks every segment in segments except held (already locked by the caller).
+    Only the tree lock holder takes more than one segment lock, so the order does not matter
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::lockSegments(vector<int> &segments, int held){
+    for(u_int i = 0; i<segments.size(); i++){
+        if(segments[i] != held) lockVersion(segmentVersion[segments[i]]);
     }
-
-    //Will be handled later
 }
 
-void PMA::deleteSegment(int targetSegment){
-    freeSegmentCount++;
-    freeKeySegmentBuffer.push_back(key_chunks[targetSegment]);
-    freeValueSegmentBuffer.push_back(value_chunks[targetSegment]);
-
-    key_chunks.erase(key_chunks.begin() + targetSegment);
-    value_chunks.erase(value_chunks.begin() + targetSegment);
-    smallest.erase(smallest.begin() + targetSegment);
-    lastElementPos.erase(lastElementPos.begin() + targetSegment);
-    cardinality.erase(cardinality.begin() + targetSegment);
-    bitmap.erase(bitmap.begin() + targetSegment);
-    totalSegments--;
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::unlockSegments(vector<int> &segments, int held){
+    for(u_int i = 0; i<segments.size(); i++){
+        if(segments[i] != held) unlockVersion(segmentVersion[segments[i]]);
+    }
 }
 
-bool PMA::lookup(type_t key){
-    int targetSegment = tree->searchSegment(key);
+/*
+    Brackets the changes of tree nodes in a split or merge, which readers validate their descent against.
+    Elements are moved before, under the segment locks only, so readers of other segments go on meanwhile
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::lockTree(){
+    if(concurrent) lockVersion(treeVersion);
+}
 
-    type_t position = findLocation(key, targetSegment);
-    type_t * segmentOffsetKey = key_chunks[targetSegment];
-    type_t * segmentOffsetVal = value_chunks[targetSegment];
-    type_t foundKey = *(segmentOffsetKey + position);
-    type_t foundVal = *(segmentOffsetVal + position);
-    if(foundKey*10 != foundVal) {cout<<"error in the tree while searching"<<endl; exit(0);}
-    if(foundKey == key) return true;  
-    return false;
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::unlockTree(){
+    if(concurrent) unlockVersion(treeVersion);
 }
 
-type_t PMA::findLocation(type_t key, int targetSegment){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t start = 0, end = lastElementPos[targetSegment];
-    int blockPosition, bitPosition, mask;
-    type_t data, mid = 0;
-    while(start <= end){
-        mid = (start + end) / 2;
-        blockPosition = mid / JacobsonIndexSize;
-        bitPosition = mid % JacobsonIndexSize;
-        mask = 1 << bitPosition;
-        if((bitmap[targetSegment][blockPosition] & mask) == 0){
-            int64_t changedMid = mid, offset = -1;
-            while(changedMid >= start){
-                changedMid += offset;
-                blockPosition = changedMid / JacobsonIndexSize;
-                bitPosition = changedMid % JacobsonIndexSize;
-                mask = 1 << bitPosition;
-                if((bitmap[targetSegment][blockPosition] & mask) !=0) break;
-            }
-            if(changedMid < start){
-                changedMid = mid;
-                offset = 1;
-                while(changedMid <= end){
-                    changedMid += offset;
-                    blockPosition = changedMid / JacobsonIndexSize;
-                    bitPosition = changedMid % JacobsonIndexSize;
-                    mask = 1 << bitPosition;
-                    if((bitmap[targetSegment][blockPosition] & mask) !=0 ) break;
-                }
-                if(changedMid > end){
-                    return mid;
-                }else mid = changedMid;
-            }else mid = changedMid;
-        }
-        data = *(segmentOffset + mid);
-        if(data == key) return mid;
-        else if(data < key) start = mid + 1;
-        else end = mid - 1;
+/*
+    Redistributes a full segment under layoutLock. Writers never wait for layoutLock while
+    holding a segment lock, so taking the segment locks here cannot deadlock
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::splitConcurrent(int targetSegment){
+    lock_guard<mutex> layout(layoutLock);
+    lockVersion(segmentVersion[targetSegment]);
+    //Another writer may have split it first, or a merge may have moved or removed the segment
+    if(targetSegment < totalSegments && cardinality[targetSegment] > (tree->level[0]*elementsInSegment)){
+        typename tree_t::path p;
+        tree->findLeaf(smallest[targetSegment], p);
+        tree->redistributeInsert(targetSegment, smallest[targetSegment], this, p);
     }
-    return mid;
+    unlockVersion(segmentVersion[targetSegment]);
 }
 
-type_t PMA::findLocation2(type_t key, int targetSegment){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t start = 0;
-    type_t end = lastElementPos[targetSegment];
-    type_t data, mid = 0;
-    int blockPosition, bitPosition, mask;
-    while(start<=end){
-        mid = (start+end)/2;
-        blockPosition = mid / JacobsonIndexSize;
-        bitPosition = mid % JacobsonIndexSize;
-        mask = 1 << bitPosition;
-        if((bitmap[targetSegment][blockPosition] & mask) == 0){
-            type_t base = blockPosition * JacobsonIndexSize;
-            bool over = false, found = false;
-            while(true){
-                u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-                if(UNLIKELY(ar[0] == 0)){
-                    blockPosition++;
-                    base += JacobsonIndexSize;
-                    if(blockPosition >= blocksInSegment || base > end) break;
-                    continue;
-                }
-                for(int i = 1; i<=ar[0]; i++){
-                    if(base + ar[i] > mid) {
-                        if(base + ar[i] <= end) {mid = base + ar[i]; found = true;}
-                        else over = true;
-                        break;
-                    }
-                }
-                if(found || over) break;
-                blockPosition++;
-                base += JacobsonIndexSize;
-            }
-            if(!found){
-                blockPosition = mid / JacobsonIndexSize;
-                type_t base = blockPosition * JacobsonIndexSize;
-                while(true){
-                    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-                    if(UNLIKELY(ar[0] == 0)){
-                        blockPosition--;
-                        base -= JacobsonIndexSize;
-                        if(blockPosition < 0 || base < start) return mid;
-                        continue;
-                    }
-                    for(int i = ar[0]; i>0; i--){
-                        if(base + ar[i] < mid){
-                            if(base + ar[i] < start) return mid;
-                            mid = base + ar[i];
-                            found = true;
-                            break;
-                        }
-                    }
-                    if(found) break;
-                    blockPosition--;
-                    base -= JacobsonIndexSize;
-                }
-            }
+/*
+    Merges or rebalances a sparse segment under layoutLock, like splitConcurrent
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::mergeConcurrent(int targetSegment){
+    bool due;
+    {
+        lock_guard<mutex> layout(layoutLock);
+        lockVersion(segmentVersion[targetSegment]);
+        if(targetSegment < totalSegments && cardinality[targetSegment] < (tree->lowerLevel*elementsInSegment)){
+            typename tree_t::path p;
+            tree->findLeaf(smallest[targetSegment], p);
+            tree->redistributeRemove(targetSegment, smallest[targetSegment], this, p);
         }
-        data = *(segmentOffset + mid);
-        if(data == key) return mid;
-        else if(data < key) start = mid + 1;
-        else end = mid - 1;
+        due = shrinkDue();
+        unlockVersion(segmentVersion[targetSegment]);
     }
-    return mid;
+    if(due) startShrink();
 }
 
-void PMA::printAllElements(){
-    tree->printAllElements(this);
+/*
+    Runs shrink_to_fit on a background thread unless one is already running
+ */
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::startShrink(){
+    if(shrinking.exchange(true)) return;
+    lock_guard<mutex> guard(shrinkerLock);
+    if(shrinker.joinable()) shrinker.join();
+    shrinker = thread([this]{
+        shrink_to_fit();
+        shrinking.store(false);
+    });
 }
 
-tuple<type_t, type_t> PMA::range_sum(type_t startKey, type_t endKey){
-    int targetSegment = searchSegment(startKey);
-
-    type_t position = findLocation(startKey, targetSegment);
-    type_t sum_key = 0, sum_value = 0;
-    type_t blockNo = position/JacobsonIndexSize;
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    type_t * segmentKeyOffset = key_chunks[targetSegment];
-    type_t * segmentValOffset = value_chunks[targetSegment];
-    type_t pbase = blockNo * JacobsonIndexSize;
-
-    //Range starts somewhere within this block
-    bool flag = false;
-    for(int offset = 1; offset <= ar[0] ; offset++){
-        type_t key = *(segmentKeyOffset+pbase+ar[offset]);
-        if(flag && key > endKey) flag = false;
-        else if(!flag && key >= startKey) flag = true;
-        if(flag) {
-            sum_key += key;
-            sum_value += *(segmentValOffset+pbase+ar[offset]);
+template <typename Key, typename Value, typename Config>
+optional<Value> PMA<Key, Value, Config>::getConcurrent(Key key){
+    while(true){
+        uint64_t treeSeen = readVersion(treeVersion);
+        if(UNLIKELY(treeSeen & 1)){
+            _mm_pause();
+            continue;
+        }
+        int targetSegment = tree->searchSegment(key);
+        //A descent racing a split can read a stale slot, the tree check below discards it
+        if(UNLIKELY(targetSegment < 0 || targetSegment >= totalSegments)) continue;
+        uint64_t segmentSeen = readVersion(segmentVersion[targetSegment]);
+        if(UNLIKELY(segmentSeen & 1)){
+            _mm_pause();
+            continue;
         }
+
+        type_t position = findLocation(key, targetSegment);
+        Key foundKey = key_chunks[targetSegment][position];
+        Value foundVal = value_chunks[targetSegment][position];
+        bool found = foundKey == key && isOccupied(targetSegment, position);
+        if(!validateVersion(segmentVersion[targetSegment], segmentSeen) || !validateVersion(treeVersion, treeSeen)) continue;
+        if(!found) return nullopt;
+        return foundVal;
     }
+}
 
-    type_t * key_pos, *value_pos;
-    int offset;
-    while(LIKELY(true)){
-        pbase += JacobsonIndexSize;
-        blockNo++;
-        if(blockNo == blocksInSegment){
-            blockNo = 0;
-            pbase = 0;
-            targetSegment++;
-            if(UNLIKELY(targetSegment == totalSegments)) return {sum_key, sum_value};
-            segmentKeyOffset = key_chunks[targetSegment];
-            segmentValOffset = value_chunks[targetSegment];
-        }
-        ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-        key_pos = segmentKeyOffset + pbase;
-        value_pos = segmentValOffset + pbase;
-        offset = ar[0];
-        switch (offset){
-            case 1:
-                sum_key += *(key_pos + ar[1]);
-                sum_value += *(value_pos + ar[1]);
-                break;
-            case 2:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                break;
-            case 3:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                break;
-            case 4:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                break;
-            case 5:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                break;
-            case 6:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                break;
-            case 7:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                break;
-            case 8:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                break;
-            case 9:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                break;
-            case 10:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                break;
-            case 11:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                break;
-            case 12:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                break;
-            case 13:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                break;
-            case 14:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_key += *(key_pos + ar[14]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                sum_value += *(value_pos + ar[14]);
-                break;
-            case 15:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_key += *(key_pos + ar[14]);
-                sum_key += *(key_pos + ar[15]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                sum_value += *(value_pos + ar[14]);
-                sum_value += *(value_pos + ar[15]);
+/*
+    Each segment is summed under its own version and retried alone if a writer changed it.
+    A split moves elements between segments, then the whole scan starts over. Segments come from
+    the leaf chain as in range_sum; unlinked leaves are only retired, so the chain stays readable
+ */
+template <typename Key, typename Value, typename Config>
+tuple<type_t, type_t> PMA<Key, Value, Config>::rangeSumConcurrent(Key startKey, Key endKey){
+    while(true){
+        uint64_t treeSeen = readVersion(treeVersion);
+        if(UNLIKELY(treeSeen & 1)){
+            _mm_pause();
+            continue;
+        }
+        typename tree_t::leaf *l = tree->findLeaf(startKey);
+        int child = childSlot(l->key, l->childCount - 1, startKey);
+        int targetSegment = l->segNo[child];
+        if(UNLIKELY(targetSegment < 0 || targetSegment >= totalSegments) || !validateVersion(treeVersion, treeSeen)) continue;
+
+        type_t sum_key = 0, sum_value = 0;
+        bool first = true, restart = false;
+        while(true){
+            typename tree_t::leaf *following = child + 1 < l->childCount ? l : l->nextLeaf;
+            int next = following == NULL ? -1 : following->segNo[following == l ? child + 1 : 0];
+            if(next >= 0 && next < totalSegments) prefetchSegment(next);
+
+            uint64_t segmentSeen = readVersion(segmentVersion[targetSegment]);
+            if(UNLIKELY(segmentSeen & 1)){
+                _mm_pause();
+                continue;
+            }
+            type_t position = first ? findLocation(startKey, targetSegment) : 0;
+            type_t segmentKey = 0, segmentValue = 0;
+            bool ended = sumSegment(targetSegment, position, startKey, endKey, segmentKey, segmentValue);
+            if(!validateVersion(segmentVersion[targetSegment], segmentSeen)){
+                if(!validateVersion(treeVersion, treeSeen)){
+                    restart = true;
+                    break;
+                }
+                continue;
+            }
+            sum_key += segmentKey;
+            sum_value += segmentValue;
+            first = false;
+            if(ended) break;
+            if(++child >= l->childCount){
+                l = l->nextLeaf;
+                child = 0;
+                if(l == NULL) break;
+            }
+            targetSegment = l->segNo[child];
+            if(UNLIKELY(targetSegment < 0 || targetSegment >= totalSegments)){
+                restart = true;
                 break;
-            case 16:
-                sum_key += *key_pos;
-                sum_key += *(key_pos + 1);
-                sum_key += *(key_pos + 2);
-                sum_key += *(key_pos + 3);
-                sum_key += *(key_pos + 4);
-                sum_key += *(key_pos + 5);
-                sum_key += *(key_pos + 6);
-                sum_key += *(key_pos + 7);
-                sum_key += *(key_pos + 8);
-                sum_key += *(key_pos + 9);
-                sum_key += *(key_pos + 10);
-                sum_key += *(key_pos + 11);
-                sum_key += *(key_pos + 12);
-                sum_key += *(key_pos + 13);
-                sum_key += *(key_pos + 14);
-                sum_key += *(key_pos + 15);
-                sum_value += *value_pos;
-                sum_value += *(value_pos + 1);
-                sum_value += *(value_pos + 2);
-                sum_value += *(value_pos + 3);
-                sum_value += *(value_pos + 4);
-                sum_value += *(value_pos + 5);
-                sum_value += *(value_pos + 6);
-                sum_value += *(value_pos + 7);
-                sum_value += *(value_pos + 8);
-                sum_value += *(value_pos + 9);
-                sum_value += *(value_pos + 10);
-                sum_value += *(value_pos + 11);
-                sum_value += *(value_pos + 12);
-                sum_value += *(value_pos + 13);
-                sum_value += *(value_pos + 14);
-                sum_value += *(value_pos + 15);
-        }
-        if(*(key_pos + ar[offset]) > endKey){
-            while(offset > 0 && *(key_pos + ar[offset]) > endKey){
-                sum_key -= *(key_pos + ar[offset]);
-                sum_value -= *(value_pos + ar[offset]);
-                offset--;
             }
-		    return {sum_key, sum_value};
-	    }
+        }
+        if(restart || !validateVersion(treeVersion, treeSeen)) continue;
+        return {sum_key, sum_value};
     }
-    return {sum_key, sum_value};
 }
 
-void PMA::printSegElements(int targetSegment){
-    type_t * key = key_chunks[targetSegment];
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::printSegElements(int targetSegment){
+    Key * key = key_chunks[targetSegment];
     type_t pBase = 0;
     for(type_t block = 0; block<blocksInSegment; block++){
-        u_short bitpos = 1;
+        bitmap_t bitpos = 1;
         cout <<" Bitmap: "<<bitmap[targetSegment][block]<<" ";
         for(type_t j = 0; j<JacobsonIndexSize; j++){
             if(bitmap[targetSegment][block] & bitpos)
@@ -883,14 +2465,18 @@ void PMA::printSegElements(int targetSegment){
     cout<<"last offset: "<<lastElementPos[targetSegment] <<" Cardinality: "<<cardinality[targetSegment]<<" Total Segment: "<<totalSegments<< endl;
 }
 
-void PMA::printStat(){
+template <typename Key, typename Value, typename Config>
+void PMA<Key, Value, Config>::printStat(){
     type_t totalElements = 0;
     for(type_t i = 0; i<totalSegments; i++){
         totalElements += cardinality[i];
     }
     cout<<"Total elements: "<<totalElements<<endl;
     cout<<"Total Segment: "<<totalSegments<<", Free Segments: "<<freeSegmentCount<<", Elements in a Segment: "<<elementsInSegment<<endl;
-    cout<<"Redistribute with insert: "<<redisInsCount<<", Redistribute with update: "<<redisUpCount<<endl;
+    cout<<"Redistribute with insert: "<<redisInsCount<<", Redistribute with update: "<<redisUpCount<<", Redistribute with remove: "<<redisRemCount<<endl;
+    if(numaPolicy != NumaFirstTouch){
+        cout<<"NUMA nodes: "<<freeKeySegmentBuffer.size()<<", segments scanned local: "<<localAccesses<<", remote: "<<remoteAccesses<<endl;
+    }
     /*
     vector<BPlusTree::node *> temp;
     temp.push_back(tree->root);
@@ -900,28 +2486,40 @@ void PMA::printStat(){
 }
 
 
-BPlusTree::BPlusTree(PMA *obj){
+template <typename Key, typename Value, typename Config>
+BPlusTree<Key, Value, Config>::BPlusTree(PMA<Key, Value, Config> *obj){
     root = NULL;
     calculateThreshold();
 }
 
-void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::insertInTree(int chunkNo, Key search_key, PMA<Key, Value, Config> *obj){
     if(UNLIKELY(root == NULL)){
         root = new Node();
         leaf *leafNode = new leaf();
         root->child_ptr[0] = (node *)leafNode;
-        root->key[0] = INT64_MAX;
+        root->key[0] = numeric_limits<Key>::max();
         root->ptrCount = 1;
         root->nodeLeaf = true;
 
         leafNode->segNo[0] = chunkNo;
-        leafNode->key[0] = INT64_MAX;
+        leafNode->key[0] = numeric_limits<Key>::max();
         leafNode->childCount = 1;
         return;
     }
+    path p;
+    findLeaf(search_key, p);
+    insertInTree(chunkNo, search_key, obj, p);
+}
 
-    leaf *leaf = findLeaf(search_key);
-    if(leaf->childCount < Leaf_Degree){ //insert in leaf
+/*
+    Adds segment chunkNo to the leaf p was recorded down to for search_key. A full leaf is split and
+    the split climbs the path
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::insertInTree(int chunkNo, Key search_key, PMA<Key, Value, Config> *obj, path &p){
+    leaf *leaf = p.l;
+    if(leaf->childCount < Config::leafDegree){ //insert in leaf
         if(leaf->childCount == 1){
             int segNo = leaf->segNo[0];
             if(obj->smallest[segNo] > search_key){
@@ -969,8 +2567,8 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
     }
     //Leaf is not empty. Divide.
     //Copy the key-value pairs
-    type_t key_store[Leaf_Degree+1];
-    int segNo_store[Leaf_Degree+1];
+    Key key_store[Config::leafDegree+1];
+    int segNo_store[Config::leafDegree+1];
     int position;
     bool done = false;
     for(position = leaf->childCount-1; position>0; position--){
@@ -1012,25 +2610,28 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
     }
 
     //Copying done. Create two nodes
-    BPlusTree::leaf *l2 = new BPlusTree::leaf();
-    for(int halfLeaf = 0; halfLeaf <= Leaf_Degree/2; halfLeaf++){
+    Leaf *l2 = new Leaf();
+    for(int halfLeaf = 0; halfLeaf <= Config::leafDegree/2; halfLeaf++){
         leaf->segNo[halfLeaf] = segNo_store[halfLeaf];
         leaf->key[halfLeaf] = key_store[halfLeaf];
     }
-    for(int nextHalf = Leaf_Degree/2 + 1, index = 0; nextHalf <= Leaf_Degree; nextHalf++, index++){
+    for(int nextHalf = Config::leafDegree/2 + 1, index = 0; nextHalf <= Config::leafDegree; nextHalf++, index++){
         l2->segNo[index] = segNo_store[nextHalf];
         l2->key[index] = key_store[nextHalf];
     }
-    leaf->childCount = Leaf_Degree/2 + 1;
-    l2->childCount = Leaf_Degree + 1 - leaf->childCount;
+    leaf->childCount = Config::leafDegree/2 + 1;
+    l2->childCount = Config::leafDegree + 1 - leaf->childCount;
     l2->nextLeaf = leaf->nextLeaf;
     leaf->nextLeaf = l2;
-    type_t key_parent = obj->smallest[leaf->segNo[0]];
-    insert_in_parent(leaf,key_store[Leaf_Degree/2],l2, key_parent);
+    insert_in_parent(leaf,key_store[Config::leafDegree/2],l2, p, p.depth);
 }
 
-void BPlusTree::insert_in_parent(void *left, type_t search_key, void *right, type_t key_parent){
-    if(left == root || right == root){
+/*
+    Adds right next to left in the parent of left, which is p.nodes[depth-1] (left is the root for depth 0)
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::insert_in_parent(void *left, Key search_key, void *right, path &p, int depth){
+    if(depth == 0){
         node *N = new node();
         N->child_ptr[0] = (node *)left;
         N->child_ptr[1] = (node *)right;
@@ -1039,8 +2640,8 @@ void BPlusTree::insert_in_parent(void *left, type_t search_key, void *right, typ
         root = N;
         return;
     }
-    node *N = findParent(left, key_parent);
-    if(N->ptrCount < Tree_Degree){
+    node *N = p.nodes[depth-1];
+    if(N->ptrCount < Config::treeDegree){
         for(int position = N->ptrCount-1; position >= 0; position--){
             if(N->child_ptr[position] == left){
                 N->child_ptr[position+1] = (node *)right;
@@ -1055,8 +2656,8 @@ void BPlusTree::insert_in_parent(void *left, type_t search_key, void *right, typ
         cout<<"Program should never reach here. Insert in Parent node of B+ Tree"<<endl;
         exit(0);
     }
-    type_t key_store[Tree_Degree+1];
-    Node *ptr_store[Tree_Degree+1];
+    Key key_store[Config::treeDegree+1];
+    Node *ptr_store[Config::treeDegree+1];
     int position;
     bool done = false;
     for(position = N->ptrCount-1; position >= 0; position--){
@@ -1076,441 +2677,643 @@ void BPlusTree::insert_in_parent(void *left, type_t search_key, void *right, typ
 
     //Spilit records into two nodes
     node *N2 = new node();
-    for(int half = 0; half <= Tree_Degree/2; half++){
+    for(int half = 0; half <= Config::treeDegree/2; half++){
         N->child_ptr[half] = ptr_store[half];
         N->key[half] = key_store[half];
     }
-    for(int nextHalf = Tree_Degree/2 + 1, index = 0; nextHalf <= Tree_Degree; nextHalf++, index++){
+    for(int nextHalf = Config::treeDegree/2 + 1, index = 0; nextHalf <= Config::treeDegree; nextHalf++, index++){
         N2->child_ptr[index] = ptr_store[nextHalf];
         N2->key[index] = key_store[nextHalf];
     }
-    N->ptrCount = Tree_Degree/2 + 1;
-    N2->ptrCount = Tree_Degree + 1 - N->ptrCount;
+    N->ptrCount = Config::treeDegree/2 + 1;
+    N2->ptrCount = Config::treeDegree + 1 - N->ptrCount;
     N2->nodeLeaf = N->nodeLeaf;
-    insert_in_parent(N, key_store[Tree_Degree/2], N2, key_parent);
+    insert_in_parent(N, key_store[Config::treeDegree/2], N2, p, depth-1);
+}
+
+template <typename Key, typename Value, typename Config>
+typename BPlusTree<Key, Value, Config>::leaf* BPlusTree<Key, Value, Config>::findLeaf(Key search_key){
+    node *temp = root;
+    while(!temp->nodeLeaf) temp = temp->child_ptr[childSlot(temp->key, temp->ptrCount - 1, search_key)];
+    return (leaf *)temp->child_ptr[childSlot(temp->key, temp->ptrCount - 1, search_key)];
 }
 
-BPlusTree::node* BPlusTree::findParent(void *n, type_t search_key){
-    if(n == root) return NULL;
-    node *parent = root;
+/*
+    findLeaf that also records the nodes passed on the way down in p
+ */
+template <typename Key, typename Value, typename Config>
+typename BPlusTree<Key, Value, Config>::leaf* BPlusTree<Key, Value, Config>::findLeaf(Key search_key, path &p){
+    node *temp = root;
+    p.depth = 0;
     while(true){
-        bool found = false;
-        for(int position = parent->ptrCount-1; position>0; position--){
-            if(parent->key[position-1] <= search_key){
-                if(n == parent->child_ptr[position]) return parent;
-                else{
-                    parent = parent->child_ptr[position];
-                    found = true; 
-                    break;
-                }
-            }
-        }
-        if(!found){
-            if(n == parent->child_ptr[0]) return parent;
-            parent = parent->child_ptr[0];
-        }
+        p.nodes[p.depth++] = temp;
+        int child = childSlot(temp->key, temp->ptrCount - 1, search_key);
+        bool lastLevel = temp->nodeLeaf;
+        temp = temp->child_ptr[child];
+        if(lastLevel) break;
     }
+    p.l = (leaf *)temp;
+    return p.l;
+}
+
+template <typename Key, typename Value, typename Config>
+int BPlusTree<Key, Value, Config>::searchSegment(Key search_key){
+    leaf *leaf = findLeaf(search_key);
+    return leaf->segNo[childSlot(leaf->key, leaf->childCount - 1, search_key)];
+}
+
+//searchSegment for writers, the descent is kept in p for redistributeInsert and redistributeRemove
+template <typename Key, typename Value, typename Config>
+int BPlusTree<Key, Value, Config>::searchSegment(Key search_key, path &p){
+    leaf *l = findLeaf(search_key, p);
+    return l->segNo[childSlot(l->key, l->childCount - 1, search_key)];
 }
 
-BPlusTree::leaf* BPlusTree::findLeaf(type_t search_key){
+/*
+    Same as searchSegment but also returns the first key routed to the next segment
+    (the largest Key for the last segment)
+ */
+template <typename Key, typename Value, typename Config>
+int BPlusTree<Key, Value, Config>::searchSegment(Key search_key, Key &upperBound){
     node *temp = root;
-    while(!temp->nodeLeaf){
-        int smallest;
-        for(smallest = temp->ptrCount - 1; smallest > 0; smallest--){
-            if(temp->key[smallest-1] <= search_key) break;
-        }
-        temp = temp->child_ptr[smallest];
-    }
-    for(int smallest = temp->ptrCount - 1; smallest > 0; smallest--){
-        if(temp->key[smallest-1] <= search_key) return (leaf *)temp->child_ptr[smallest];
+    upperBound = numeric_limits<Key>::max();
+    while(true){
+        int child = childSlot(temp->key, temp->ptrCount - 1, search_key);
+        if(child < temp->ptrCount - 1) upperBound = temp->key[child];
+        bool lastLevel = temp->nodeLeaf;
+        temp = temp->child_ptr[child];
+        if(lastLevel) break;
     }
-    return (leaf *)temp->child_ptr[0];
+    leaf *l = (leaf *)temp;
+    int child = childSlot(l->key, l->childCount - 1, search_key);
+    if(child < l->childCount - 1) upperBound = l->key[child];
+    return l->segNo[child];
 }
 
-int BPlusTree::searchSegment(type_t search_key){
-    leaf *leaf = findLeaf(search_key);
-    if(leaf->childCount == 1) return leaf->segNo[0];
-    for(int smallest = leaf->childCount - 1; smallest > 0; smallest--){
-        if(leaf->key[smallest-1] <= search_key) return leaf->segNo[smallest];
+/*
+    Replaces the tree with one built bottom-up over segments (given in key order).
+    Leaves and nodes are packed evenly and kept one child short of full, so the
+    first splits after loading do not cascade to the root.
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::buildFromSegments(vector<int> &segments, PMA<Key, Value, Config> *obj){
+    if(root != NULL) deleteNode(root);
+    root = NULL;
+    if(segments.empty()) return;
+
+    //Leaf level
+    vector<void *> level;
+    vector<Key> low;
+    size_t count = segments.size();
+    size_t groups = (count + Config::leafDegree - 2) / (Config::leafDegree - 1);
+    leaf *prev = NULL;
+    for(size_t g = 0, pos = 0; g < groups; g++){
+        size_t children = count / groups + (g < count % groups ? 1 : 0);
+        leaf *l = new leaf();
+        for(size_t c = 0; c < children; c++, pos++){
+            l->segNo[c] = segments[pos];
+            if(c > 0) l->key[c-1] = obj->smallest[segments[pos]];
+        }
+        if(children == 1) l->key[0] = numeric_limits<Key>::max();
+        l->childCount = children;
+        if(prev != NULL) prev->nextLeaf = l;
+        prev = l;
+        level.push_back(l);
+        low.push_back(obj->smallest[l->segNo[0]]);
     }
-    return leaf->segNo[0];
+
+    //Inner levels until a single root is left
+    bool nodeLeaf = true;
+    do{
+        vector<void *> upper;
+        vector<Key> upperLow;
+        count = level.size();
+        groups = (count + Config::treeDegree - 2) / (Config::treeDegree - 1);
+        for(size_t g = 0, pos = 0; g < groups; g++){
+            size_t children = count / groups + (g < count % groups ? 1 : 0);
+            node *N = new node();
+            for(size_t c = 0; c < children; c++, pos++){
+                N->child_ptr[c] = (node *)level[pos];
+                if(c > 0) N->key[c-1] = low[pos];
+            }
+            if(children == 1) N->key[0] = numeric_limits<Key>::max();
+            N->ptrCount = children;
+            N->nodeLeaf = nodeLeaf;
+            upper.push_back(N);
+            upperLow.push_back(low[pos-children]);
+        }
+        level.swap(upper);
+        low.swap(upperLow);
+        nodeLeaf = false;
+    }while(level.size() > 1);
+    root = (node *)level[0];
 }
 
-void BPlusTree::calculateThreshold(){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::calculateThreshold(){
     level[0] = 0.95;
     level[MaxLevel] = 0.50;
     for(int i = 1; i<MaxLevel; i++){
         level[i] = level[0] - ((level[0]-level[MaxLevel])/(MaxLevel-i));
     }
+    lowerLevel = 0.10;
 }
 
-void BPlusTree::redistributeInsert(int segment, type_t SKey, PMA *obj){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::redistributeInsert(int segment, Key SKey, PMA<Key, Value, Config> *obj, path &p){
     obj->redisInsCount++;
-    leaf *par = findLeaf(SKey);
-    if(findCardinality(par, obj) >= (level[1]*Leaf_Degree*SEGMENT_SIZE/8)){
-        cout<<"Got upper level of tree"<<endl;
-        node *parent = findParent(par, SKey);
-        type_t nodeCard = findCardinality(parent, obj);
-        int tree_Degree_Count = Leaf_Degree * Tree_Degree;
-        if(nodeCard >= level[2]*tree_Degree_Count*SEGMENT_SIZE/8){
-            int cLevel = 2;
-            while(nodeCard >= level[cLevel]*tree_Degree_Count*SEGMENT_SIZE/8){
-                cLevel++;
-                tree_Degree_Count *= Tree_Degree;
-                parent = findParent(parent, SKey);
-                nodeCard = findCardinality(parent, obj);
-                if (parent == root) break;
-            }
-            vector<int> segments;
-            listSegments(segments, parent);
-            //Logically delete the branch
-            leaf *left = leftmostLeaf(parent);
-            left = findLeaf(obj->smallest[left->segNo[0]]);
-            leaf *right = rightmostLeaf(parent);
-            left->nextLeaf = right->nextLeaf;
-            //Physically delete
-            deleteNode(parent);
-    
-            reinsertInTree(segments, nodeCard, obj);
-        }else{ //Only redistribute the segments under the leaf node
-            nodeCard = findCardinality(par, obj);
-            vector<int> segments;
-            for(int i=0; i < par->childCount; i++){
-                segments.push_back(par->segNo[i]);
-            }
-            
-            if(obj->smallest[par->segNo[0]] != 0){
-                deleteLeaf(par, obj->smallest[par->segNo[0]]);
-                //delete par;
-            }
-            reinsertInTree(segments, nodeCard, obj);
+    leaf *par = p.l;
+    if(findCardinality(par, obj) < (level[1]*Config::leafDegree*obj->elementsInSegment)){
+        //Divide in 2 segments. The new one goes in the same leaf
+        int segNo = obj->redistributeWithDividing(segment);
+        obj->lockTree();
+        insertInTree(segNo, obj->smallest[segNo], obj, p);
+        obj->unlockTree();
+        return;
+    }
+
+    //The leaf is dense. Redistribute under it, or under the lowest ancestor that is not dense
+    //when its parent is dense as well
+    vector<int> segments;
+    int depth = p.depth - 1;
+    node *parent = p.nodes[depth];
+    type_t nodeCard = findCardinality(parent, obj);
+    int tree_Degree_Count = Config::leafDegree * Config::treeDegree;
+    if(nodeCard >= level[2]*tree_Degree_Count*obj->elementsInSegment){
+        int cLevel = 2;
+        while(depth > 0 && nodeCard >= level[cLevel]*tree_Degree_Count*obj->elementsInSegment){
+            cLevel++;
+            tree_Degree_Count *= Config::treeDegree;
+            parent = p.nodes[--depth];
+            nodeCard = findCardinality(parent, obj);
         }
+        listSegments(segments, parent);
+        if(obj->concurrent) obj->lockSegments(segments, segment);
+        reinsertInTree(segments, nodeCard, obj);
+        obj->lockTree();
+        relabel(parent, obj);
     }else{
-        //Divide in 2 segments
-        int segNo = obj->redistributeWithDividing(segment);
-        insertInTree(segNo, obj->smallest[segNo], obj);
+        for(int i=0; i < par->childCount; i++){
+            segments.push_back(par->segNo[i]);
+        }
+        if(obj->concurrent) obj->lockSegments(segments, segment);
+        reinsertInTree(segments, findCardinality(par, obj), obj);
+        obj->lockTree();
+        relabel(par, obj);
+    }
+
+    //Segments added by the redistribution go in after the ones they follow. The window stays locked
+    //until they are in, its segments no longer hold the keys routed on to them
+    for(u_int i = 0; i<obj->spreadSegments.size(); i++){
+        insertInTree(obj->spreadSegments[i], obj->smallest[obj->spreadSegments[i]], obj);
     }
+    obj->unlockTree();
+    if(obj->concurrent) obj->unlockSegments(segments, segment);
 }
 
-void BPlusTree::reinsertInTree(vector<int> &segments, type_t cardi, PMA *obj){
-    vector<type_t *> usedKeySegments;
-    vector<type_t *> usedValSegment;
-    vector<type_t> smallest;
-    vector<type_t> lastElementPos;
-    vector<int> cardinality;
-    vector<vector<u_short>> bitmap;
+/*
+    Handles a segment that went under lowerLevel. It is merged with a neighbour when both fit at split
+    density, else the two are rebalanced. The neighbour is the next segment in the same leaf (the previous
+    one for the last child). A segment alone in its leaf pairs with the last segment of the previous leaf,
+    or with the first one of the next leaf in the leftmost leaf. A merged-away segment leaves the tree and
+    its slot is freed; a leaf left empty is removed as well
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::redistributeRemove(int segment, Key SKey, PMA<Key, Value, Config> *obj, path &p){
+    leaf *l = p.l;
+    int child = 0;
+    while(child < l->childCount && l->segNo[child] != segment) child++;
+    if(UNLIKELY(child == l->childCount)) return;
+
+    leaf *ll = l, *rl = l;                      //Leaves of the left and right segment of the pair
+    int leftChild, rightChild;
+    if(l->childCount > 1){
+        rightChild = child + 1 < l->childCount ? child + 1 : child;
+        leftChild = rightChild - 1;
+    }else{
+        leaf *prev = SKey > numeric_limits<Key>::min() ? findLeaf(SKey - 1) : l;
+        if(prev != l){
+            ll = prev;
+            leftChild = prev->childCount - 1;
+        }else{
+            rl = l->nextLeaf;
+            if(rl == NULL || rl->childCount < 2) return;
+            leftChild = 0;
+        }
+        rightChild = 0;
+    }
+    int leftSeg = ll->segNo[leftChild], rightSeg = rl->segNo[rightChild];
+    Key oldBound = obj->smallest[rightSeg];
+    bool merge = obj->cardinality[leftSeg] + obj->cardinality[rightSeg] <= level[MaxLevel]*level[0]*obj->elementsInSegment;
+
+    //Lock the neighbour and, for a merge, the last segment that deleteSegment moves into the freed slot
+    vector<int> segments = {leftSeg, rightSeg};
+    int last = obj->totalSegments - 1;
+    if(merge && last != leftSeg && last != rightSeg) segments.push_back(last);
+    if(obj->concurrent) obj->lockSegments(segments, segment);
+
+    obj->redisRemCount++;
+    obj->rebalancePair(leftSeg, rightSeg, merge);
+    obj->lockTree();
+    if(merge){
+        if(rl->childCount == 1) removeLeaf(rl, ll, oldBound, p);          //Only for the lone leaf, rl is p.l
+        else{
+            for(int c = rightChild; c < rl->childCount - 1; c++) rl->segNo[c] = rl->segNo[c+1];
+            for(int c = max(rightChild - 1, 0); c < rl->childCount - 2; c++) rl->key[c] = rl->key[c+1];
+            rl->childCount--;
+            if(rightChild == 0) replaceSeparator(oldBound, obj->smallest[rl->segNo[0]]);
+        }
+        obj->deleteSegment(rightSeg);
+    }else if(rightChild > 0) rl->key[rightChild-1] = obj->smallest[rightSeg];
+    else replaceSeparator(oldBound, obj->smallest[rightSeg]);
+    obj->unlockTree();
 
-    type_t insertPos = 0;
-    type_t prevKey;
-    type_t lowestElement = 0;
-    int elementCount = 0;
-    type_t *keyStore, *valueStore;
-    bool isEmptySegment = true;
-    type_t maxGap = (type_t) MaxGap;
-    vector <u_short> blocks;
+    if(obj->concurrent) obj->unlockSegments(segments, segment);
+}
 
-    tie(keyStore, valueStore) = obj->getSegment();
-    for(int i = 0; i<obj->blocksInSegment; i++){
-        blocks.push_back(0);
+/*
+    Unlinks the empty leaf l (p.l, prev is the leaf before it, bound the bound it was routed by) from the tree
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::removeLeaf(leaf *l, leaf *prev, Key bound, path &p){
+    prev->nextLeaf = l->nextLeaf;
+    removeChild(l, bound, p, p.depth - 1);
+    freeLeaf(l);
+}
+
+/*
+    Removes child from its parent p.nodes[depth]. A node left without children is removed from its own
+    parent, and when the first child goes its bound moves up to the next one. Nodes are not merged otherwise
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::removeChild(void *child, Key bound, path &p, int depth){
+    node *n = p.nodes[depth];
+    if(n->ptrCount == 1 && depth > 0){
+        removeChild(n, bound, p, depth - 1);
+        freeNode(n);
+        return;
     }
+    int position = 0;
+    while(n->child_ptr[position] != child) position++;
+    if(position == 0) replaceSeparator(bound, n->key[0]);
+    for(int c = position; c < n->ptrCount - 1; c++) n->child_ptr[c] = n->child_ptr[c+1];
+    for(int c = max(position - 1, 0); c < n->ptrCount - 2; c++) n->key[c] = n->key[c+1];
+    n->ptrCount--;
+}
 
-    cout<<"Inside redistribution. Segments: "<<segments.size()<<" Cardinality: "<<cardi<<" Segments are: ";
-    for(u_int i = 0; i < segments.size(); i++){
-        cout<<segments[i]<<" ";
-    }cout<< " Segment Limit: "<<level[0]*SEGMENT_SIZE/128<<endl;
+/*
+    Replaces the separator oldKey, the bound of the first segment of a leaf, in the inner node that holds it
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::replaceSeparator(Key oldKey, Key newKey){
+    node *n = root;
+    while(true){
+        int position = childSlot(n->key, n->ptrCount - 1, oldKey);
+        if(position > 0 && n->key[position-1] == oldKey){
+            n->key[position-1] = newKey;
+            return;
+        }
+        if(n->nodeLeaf) return;
+        n = n->child_ptr[position];
+    }
+}
 
-    //Copy the content to new set of segments
-    for(u_int i = 0; i<segments.size(); i++){
-        int segNo = segments[i];
-        type_t *sourceKey = obj->key_chunks[segNo];
-        type_t *sourceVal = obj->value_chunks[segNo];
-        type_t position = 0;
-        for(int bl = 0; bl <obj->blocksInSegment; bl++ ){
-            u_char * ar = obj->NonZeroEntries[obj->bitmap[segNo][bl]];
-            for(int j = 1; j <= ar[0]; j++){
-                if(isEmptySegment) {
-                    *keyStore = prevKey = *(sourceKey + ar[j]);
-                    *valueStore = *(sourceVal + ar[j]);
-                    lowestElement = prevKey;
-                    elementCount++;
-                    isEmptySegment = false;
-                }else{
-                    type_t curKey = *(sourceKey + ar[j]);
-                    int gap = min(curKey - prevKey, maxGap);
-                    prevKey = curKey;
-                    if(gap < 0) {
-                        cout<<endl<<"Curlock " <<position + ar[j]<<endl;
-                        cout<<"curKey: "<<curKey<<" PrevKey: "<<prevKey<<endl;
-                        cout<<"Gap should not be negative"<<endl;
-                        printAllElements(obj);
-                        exit(0);
-                        //*keyStore = *(sourceKey-100000000);
-                    }
-                    if(insertPos + gap > obj->lastValidPos || elementCount == level[0]*SEGMENT_SIZE/8){
-                        //save prev seg
-                        usedKeySegments.push_back(keyStore);
-                        usedValSegment.push_back(valueStore);
-                        smallest.push_back(lowestElement);
-                        lastElementPos.push_back(insertPos);
-                        cardinality.push_back(elementCount);
-                        bitmap.push_back(blocks);
-
-                        //create new seg and reset variables
-                        insertPos = 0;
-                        lowestElement = 0;
-                        elementCount = 0;
-                        isEmptySegment = true;
-                        tie(keyStore, valueStore) = obj->getSegment();
-                        vector <u_short> newBlock;
-                        for(int ii = 0; ii<obj->blocksInSegment; ii++){
-                            newBlock.push_back(0);
-                        }
-                        
-                        cout<<"Before changing"<<endl;
-                        for(int ii = 0; ii<obj->blocksInSegment; ii++){
-                            cout<<" "<<blocks[ii];
-                        }
-                        blocks = newBlock;
-                        for(int ii = 0; ii<obj->blocksInSegment; ii++){
-                            cout<<" "<<blocks[ii];
-                        }
-                        j--;
-                    }else{
-                        insertPos += gap;
-                        *(keyStore + insertPos) = curKey;
-                        *(valueStore + insertPos) = *(sourceVal + ar[j]);
-                        int blockPosition = insertPos / JacobsonIndexSize;
-                        int bitPosition = insertPos % JacobsonIndexSize;
-                        u_short mask = 1 << bitPosition;
-                        blocks[blockPosition] |= mask;
-                        elementCount++;
-                    }
-                }
+/*
+    Points the leaf entry of segment from to segment to
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::renumberSegment(int from, int to, PMA<Key, Value, Config> *obj){
+    leaf *l = findLeaf(obj->smallest[from]);
+    for(int c = 0; c<l->childCount; c++){
+        if(l->segNo[c] == from){
+            l->segNo[c] = to;
+            return;
+        }
+    }
+    //An empty segment can share its bound with the next one, look through the leaf chain
+    for(l = leftmostLeaf(root); l != NULL; l = l->nextLeaf){
+        for(int c = 0; c<l->childCount; c++){
+            if(l->segNo[c] == from){
+                l->segNo[c] = to;
+                return;
             }
-            sourceKey += JacobsonIndexSize;
-            sourceVal += JacobsonIndexSize;
-            position += JacobsonIndexSize;
         }
     }
+}
 
-    //place the created segments to the final group of segments
-    for(u_int i = 0; i < segments.size(); i++){
-        obj->freeKeySegmentBuffer.push_back(obj->key_chunks[segments[i]]);
-        obj->freeValueSegmentBuffer.push_back(obj->value_chunks[segments[i]]);
-        obj->freeSegmentCount++;
+/*
+    Runs body(i) for i in [0, n) on up to threads threads, each taking a contiguous share
+ */
+template <typename F>
+static void parallelFor(size_t n, int threads, F body){
+    if(threads > (int)n) threads = n;
+    if(threads <= 1){
+        for(size_t i = 0; i<n; i++) body(i);
+        return;
     }
+    vector<thread> workers;
+    auto share = [&](int t){
+        for(size_t i = n * t / threads; i < n * (t + 1) / threads; i++) body(i);
+    };
+    for(int t = 1; t<threads; t++) workers.push_back(thread(share, t));
+    share(0);
+    for(u_int i = 0; i<workers.size(); i++) workers[i].join();
+}
 
-    u_int j = 0;
-    int lastSeg = obj->totalSegments;
-    for(u_int i=0; i<usedKeySegments.size(); i++){
-
-        if(j >= segments.size()){
-            obj->key_chunks.push_back(usedKeySegments[i]);
-            obj->value_chunks.push_back(usedValSegment[i]);
-            obj->smallest.push_back(smallest[i]);
-            obj->lastElementPos.push_back(lastElementPos[i]);
-            obj->cardinality.push_back(cardinality[i]);
-            obj->bitmap.push_back(bitmap[i]);
-            segments.push_back(lastSeg++);
-            obj->totalSegments++;
-        }else{
-            obj->key_chunks[segments[j]] = usedKeySegments[i];
-            obj->value_chunks[segments[j]] = usedValSegment[i];
-            obj->smallest[j] = smallest[i];
-            obj->lastElementPos[j] = lastElementPos[i];
-            obj->cardinality[j] = cardinality[i];
-            obj->bitmap[j] = bitmap[i];
-            j++;
+/*
+    Spreads the cardi elements of segments (in key order) evenly over enough segments to bring them
+    to level[MaxLevel] of the insert threshold. The given segments are refilled in place, the extra
+    ones are appended and listed in obj->spreadSegments (in key order) for the caller to put in the tree.
+    The window is first gathered into one run using prefix counts of cardinality, then each output
+    segment is laid out from its slice of the run. Both steps split over threads for large windows
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::reinsertInTree(vector<int> &segments, type_t cardi, PMA<Key, Value, Config> *obj){
+    size_t windowSize = segments.size();
+    vector<type_t> prefix(windowSize + 1, 0);
+    for(size_t i = 0; i<windowSize; i++) prefix[i+1] = prefix[i] + obj->cardinality[segments[i]];
+    cardi = prefix[windowSize];
+
+    //Every thread gets at least ParallelRedistributeMin segments, smaller shares cost more to start than they save
+    int threads = RedistributeThreads > 0 ? RedistributeThreads : (int)thread::hardware_concurrency();
+    threads = max(1, min(threads, (int)(windowSize / ParallelRedistributeMin)));
+
+    //Gather
+    vector<Key> keys(cardi);
+    vector<Value> values(cardi);
+    parallelFor(windowSize, threads, [&](size_t i){
+        int segNo = segments[i];
+        type_t to = prefix[i];
+        for(type_t bl = 0; bl < obj->blocksInSegment; bl++){
+            type_t pbase = bl * JacobsonIndexSize;
+            for(bitmap_t w = obj->bitmap[segNo][bl]; w != 0; w &= w - 1){
+                keys[to] = obj->key_chunks[segNo][pbase + wordFirst(w)];
+                values[to++] = obj->value_chunks[segNo][pbase + wordFirst(w)];
+            }
         }
+    });
+
+    //Output segments in key order. The window's own segments are spaced out evenly among them
+    type_t target = (type_t)(level[MaxLevel]*level[0]*obj->elementsInSegment);
+    size_t outputs = max(windowSize, (size_t)((cardi + target - 1) / target));
+    vector<int> order(outputs, -1);
+    for(size_t r = 0; r<windowSize; r++) order[r * outputs / windowSize] = segments[r];
+    obj->spreadSegments.clear();
+    for(size_t o = 0; o<outputs; o++){
+        if(order[o] >= 0) continue;
+        Key *new_key_chunk;
+        Value *new_value_chunk;
+        tie(new_key_chunk, new_value_chunk) = obj->getSegment(cardi > 0 ? obj->placeNode(keys[min((type_t)(o * cardi / outputs), cardi - 1)]) : 0);
+        obj->key_chunks.push_back(new_key_chunk);
+        obj->value_chunks.push_back(new_value_chunk);
+        obj->smallest.push_back(0);
+        obj->lastElementPos.push_back(0);
+        obj->cardinality.push_back(0);
+        obj->addBitmap(vector<bitmap_t>(obj->blocksInSegment, 0));
+        order[o] = obj->totalSegments++;
+        obj->spreadSegments.push_back(order[o]);
     }
 
-    //Check all the segments.
-    for(u_int i = 0; i <obj->key_chunks.size(); i++)
-    {
-        cout<<"Key Chunk: "<<(ulong)obj->key_chunks[i]<<endl;
-        cout<<"Smallest: "<<obj->smallest[i]<<endl;
-        cout<<"LastElementPos: "<<obj->lastElementPos[i]<<endl;
-        cout<<"Cardinality: "<<obj->cardinality[i]<<endl;
-        cout<<"Bitmap: ";
-        for(int j=0; j<obj->blocksInSegment; j++){
-            cout<<" "<<obj->bitmap[i][j];
-        }
+    //Lay out
+    parallelFor(outputs, threads, [&](size_t o){
+        type_t from = cardi * o / outputs, to = cardi * (o + 1) / outputs;
+        obj->layoutSegment(order[o], &keys[0] + from, &values[0] + from, to - from);
+    });
+    //The first segment keeps its bound, the others start at their first key. An empty one takes the bound
+    //of the next non-empty one, childSlot routes that key past it, so it gets an empty key range. Empty
+    //outputs only occur with fewer elements than window segments, all of them already in the tree.
+    //The last output is never empty unless the whole window is
+    Key bound = obj->smallest[order[0]];
+    for(size_t o = outputs - 1; o >= 1; o--){
+        type_t from = cardi * o / outputs, to = cardi * (o + 1) / outputs;
+        if(to > from) bound = keys[from];
+        obj->smallest[order[o]] = bound;
+    }
+}
+
+/*
+    Recomputes the separators under a redistributed window from the segment bounds.
+    Returns the smallest bound under it
+ */
+template <typename Key, typename Value, typename Config>
+Key BPlusTree<Key, Value, Config>::relabel(leaf *l, PMA<Key, Value, Config> *obj){
+    for(int c = 1; c<l->childCount; c++){
+        l->key[c-1] = obj->smallest[l->segNo[c]];
     }
+    return obj->smallest[l->segNo[0]];
+}
 
-    //Last part. Insert the segments to the tree
-    for(u_int i=0; i<segments.size(); i++){
-        insertInTree(segments[i], obj->smallest[segments[i]], obj);
+template <typename Key, typename Value, typename Config>
+Key BPlusTree<Key, Value, Config>::relabel(node *n, PMA<Key, Value, Config> *obj){
+    Key lowest = 0;
+    for(int c = 0; c<n->ptrCount; c++){
+        Key childLowest = n->nodeLeaf ? relabel((leaf *)n->child_ptr[c], obj) : relabel(n->child_ptr[c], obj);
+        if(c == 0) lowest = childLowest;
+        else n->key[c-1] = childLowest;
     }
+    return lowest;
 }
 
-BPlusTree::leaf* BPlusTree::rightmostLeaf(node *parent){
-    if(parent->nodeLeaf) return (leaf *)parent->child_ptr[parent->ptrCount-1];
+template <typename Key, typename Value, typename Config>
+typename BPlusTree<Key, Value, Config>::leaf* BPlusTree<Key, Value, Config>::rightmostLeaf(node *parent){
     while(!parent->nodeLeaf){
-        parent = parent->child_ptr[root->ptrCount-1];
+        parent = parent->child_ptr[parent->ptrCount-1];
     }
     return (leaf *)parent->child_ptr[parent->ptrCount-1];
 }
 
-BPlusTree::leaf* BPlusTree::leftmostLeaf(node *parent){
-    if(parent->nodeLeaf) return (leaf *)root->child_ptr[0];
+template <typename Key, typename Value, typename Config>
+typename BPlusTree<Key, Value, Config>::leaf* BPlusTree<Key, Value, Config>::leftmostLeaf(node *parent){
     while(!parent->nodeLeaf){
         parent = parent->child_ptr[0];
     }
     return (leaf *)parent->child_ptr[0];
 }
 
-void BPlusTree::listSegments(vector<int> &segments, node *parent){
-    if(parent->nodeLeaf){
-        for(int i = 0; i<parent->ptrCount; i++){
+/*
+    Segments under parent in key order
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::listSegments(vector<int> &segments, node *parent){
+    for(int i = 0; i<parent->ptrCount; i++){
+        if(parent->nodeLeaf){
             leaf *l = (leaf *)parent->child_ptr[i];
             for(int j = 0; j<l->childCount; j++){
                 segments.push_back(l->segNo[j]);
             }
-            delete l;
+        }else{
+            listSegments(segments, parent->child_ptr[i]);
         }
-        return;
-    }
-    for(int i = 0; i<parent->ptrCount; i++){
-        listSegments(segments, parent->child_ptr[i]);
-        delete parent->child_ptr[i];
     }
 }
 
-void BPlusTree::deleteNode(node *parent){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::deleteNode(node *parent){
     if(parent->nodeLeaf){
         for(int i=0; i<parent->ptrCount; i++){
-            delete (leaf *)parent->child_ptr[i];
+            freeLeaf((leaf *)parent->child_ptr[i]);
         }
-        delete parent;
+        freeNode(parent);
     }else{
         for(int i = 0; i<parent->ptrCount; i++){
             deleteNode(parent->child_ptr[i]);
-            delete parent;
         }
+        freeNode(parent);
     }
 }
 
-void BPlusTree::deleteLeaf(leaf *l, type_t SKey){
-    leaf *prev = findLeaf(SKey);
-    prev->nextLeaf = l->nextLeaf;
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::freeNode(node *n){
+    if(deferFree) retiredNodes.push_back(n);
+    else delete n;
+}
+
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::freeLeaf(leaf *l){
+    if(deferFree) retiredLeaves.push_back(l);
+    else delete l;
+}
 
-    node *par = findParent(l, SKey);
-    while(par->ptrCount == 1){
-        if(par == root) return;
-        node *par2 = findParent(par, SKey);
-        par2->child_ptr[0] = par->child_ptr[0];
-        delete par;
-        par = par2;
+/*
+    Frees the nodes unlinked in concurrent mode. No reader may be inside the tree
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::releaseRetired(){
+    for(u_int i = 0; i<retiredNodes.size(); i++) delete retiredNodes[i];
+    for(u_int i = 0; i<retiredLeaves.size(); i++) delete retiredLeaves[i];
+    retiredNodes.clear();
+    retiredLeaves.clear();
+}
+
+/*
+    Appends the subtree under n in preorder: a node's flag, child count and separators, then its children.
+    Leaves are stored with their separators and segment numbers
+ */
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::saveNode(node *n, vector<char> &out){
+    char header[2] = {(char)n->nodeLeaf, n->ptrCount};
+    putRaw(out, header, 2);
+    putRaw(out, n->key, nodeKeySlots);
+    for(int i = 0; i<n->ptrCount; i++){
+        if(!n->nodeLeaf){
+            saveNode(n->child_ptr[i], out);
+            continue;
+        }
+        leaf *l = (leaf *)n->child_ptr[i];
+        putRaw(out, &l->childCount, 1);
+        putRaw(out, l->key, leafKeySlots);
+        putRaw(out, l->segNo, Config::leafDegree);
     }
+}
 
+/*
+    Rebuilds a subtree written by saveNode and links its leaves after prev. Returns NULL, freeing what
+    was built, if the input is short or names a segment outside 0..segments-1
+ */
+template <typename Key, typename Value, typename Config>
+typename BPlusTree<Key, Value, Config>::node* BPlusTree<Key, Value, Config>::loadNode(const char *&in, const char *end, int segments, leaf *&prev, int depth){
+    char header[2];
+    if(depth >= MaxLevel || !getRaw(in, end, header, 2) || header[1] < 1 || header[1] > Config::treeDegree) return NULL;
+    node *n = new node();
+    n->nodeLeaf = header[0];
+    if(!getRaw(in, end, n->key, nodeKeySlots)){
+        delete n;
+        return NULL;
+    }
+    for(int i = 0; i<header[1]; i++){
+        void *child = NULL;
+        if(n->nodeLeaf){
+            leaf *l = new leaf();
+            bool valid = getRaw(in, end, &l->childCount, 1) && l->childCount >= 1 && l->childCount <= Config::leafDegree
+                      && getRaw(in, end, l->key, leafKeySlots) && getRaw(in, end, l->segNo, Config::leafDegree);
+            for(int j = 0; valid && j<l->childCount; j++) valid = l->segNo[j] >= 0 && l->segNo[j] < segments;
+            if(valid){
+                if(prev != NULL) prev->nextLeaf = l;
+                prev = l;
+                child = l;
+            }else delete l;
+        }else{
+            child = loadNode(in, end, segments, prev, depth + 1);
+        }
+        if(child == NULL){
+            deleteNode(n);
+            return NULL;
+        }
+        n->child_ptr[i] = (node *)child;
+        n->ptrCount = i + 1;
+    }
+    return n;
 }
 
 /*
     Returns new segment nubmer. Unsed in cases only one new segment needs to be created
  */
-int PMA:: redistributeWithDividing(int targetSegment){
+template <typename Key, typename Value, typename Config>
+int PMA<Key, Value, Config>::redistributeWithDividing(int targetSegment){
     type_t halfElement = cardinality[targetSegment]/2;
-    type_t *new_key_chunk, *new_value_chunk;
-    tie(new_key_chunk, new_value_chunk) = getSegment();
-
-    type_t * moveKeyOffset = key_chunks[targetSegment];
-    type_t * moveValOffset = value_chunks[targetSegment];
-    type_t * destKeyOffset = new_key_chunk;
-    type_t * destValOffset = new_value_chunk;
-
-    type_t copyBlock, i, j, elementCount = 0;
-
-    for(copyBlock=0; copyBlock<blocksInSegment; copyBlock++){
-        u_char * ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
-        if((elementCount + ar[0]) >= halfElement){
-            halfElement = elementCount + ar[0];
-            lastElementPos[targetSegment] = copyBlock * JacobsonIndexSize + ar[ar[0]];
-            copyBlock++;
+    Key *new_key_chunk;
+    Value *new_value_chunk;
+    tie(new_key_chunk, new_value_chunk) = getSegment(placeNode(key_chunks[targetSegment][lastElementPos[targetSegment]]));
+
+    Key * moveKeyOffset = key_chunks[targetSegment];
+    Value * moveValOffset = value_chunks[targetSegment];
+    Key * destKeyOffset = new_key_chunk;
+    Value * destValOffset = new_value_chunk;
+
+    //Find the slot of the last element that stays (select on the occupancy words)
+    type_t copyBlock, remaining = halfElement, splitPos = 0;
+    for(copyBlock = 0; copyBlock < blocksInSegment; copyBlock++){
+        int count = wordCount(bitmap[targetSegment][copyBlock]);
+        if(remaining <= count){
+            splitPos = copyBlock * JacobsonIndexSize + wordSelect(bitmap[targetSegment][copyBlock], remaining - 1);
             break;
         }
-        elementCount += ar[0];
-    }        
-    vector<u_short> blocks;
-    
-   for(int ii = 0; ii < blocksInSegment; ii++){
+        remaining -= count;
+    }
+    lastElementPos[targetSegment] = splitPos;
+
+    vector<bitmap_t> blocks;
+    for(int ii = 0; ii < blocksInSegment; ii++){
         blocks.push_back(0);
     }
 
-    //Copy the elements of current block
-    elementCount = cardinality[targetSegment]-halfElement;
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
-    while(UNLIKELY(ar[0] == 0)){
-        copyBlock++;
-        ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
-    }
-    type_t * pKeyBase = moveKeyOffset + copyBlock * JacobsonIndexSize;
-    type_t * pValBase = moveValOffset + copyBlock * JacobsonIndexSize;
-    type_t lastInput = 0, lastInsertkey = 0;
-
-    *destKeyOffset = lastInsertkey = *(pKeyBase + ar[1]);
-    *destValOffset = *(pValBase + ar[1]);
-    blocks[0] = 1;
-    for(i = 2, j = 0; i<=ar[0]; i++){
-        type_t current_element = *(pKeyBase + ar[i]);
-        int keyGap = current_element - lastInsertkey;
-        if(keyGap < MaxGap) j += keyGap;
-        else j+= MaxGap;
-        *(destKeyOffset + j) = lastInsertkey = current_element;
-        *(destValOffset + j) = *(pValBase + ar[i]);
-        int blockPosition = j / JacobsonIndexSize;
-        int bitPosition = j % JacobsonIndexSize;
-        u_short mask = 1 << bitPosition;
-        blocks[blockPosition] |= mask;
-    }
-    lastInput = j;
-    elementCount -= ar[0];
-    bitmap[targetSegment][copyBlock] = 0;
-
-    type_t lastAccessPos = lastValidPos - 1;
-    for(type_t blockno = copyBlock+1; blockno < blocksInSegment; blockno++){
-        pKeyBase += JacobsonIndexSize;
-        pValBase += JacobsonIndexSize;
-        ar = NonZeroEntries[bitmap[targetSegment][blockno]];
-        if(UNLIKELY(ar[0] == 0)){bitmap[targetSegment][blockno] = 0; continue;}
-        for(i = 1; i<=ar[0]; i++){
-            type_t current_element = *(pKeyBase + ar[i]);
-            if(elementCount < (lastAccessPos - j)){
-                type_t keyGap = current_element - lastInsertkey;
-                if(keyGap<MaxGap) j += keyGap;
-                else j+= MaxGap;
-            }else j++;
-            *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(pValBase + ar[i]);
-            int blockPosition = j / JacobsonIndexSize;
-            int bitPosition = j % JacobsonIndexSize;
-            u_short mask = 1 << bitPosition;
-            blocks[blockPosition] |= mask;
+    //Move every element after splitPos to the new segment, gaps follow the key distance (at most maxGap)
+    type_t elementCount = cardinality[targetSegment] - halfElement;
+    type_t j = -1, lastInsertkey = 0;
+    int bitPosition = splitPos % JacobsonIndexSize;
+    bitmap_t moveMask = bitPosition == JacobsonIndexSize - 1 ? 0 : ~0ULL << (bitPosition + 1);
+    for(type_t blockno = copyBlock; blockno < blocksInSegment; blockno++){
+        Key * pKeyBase = moveKeyOffset + blockno * JacobsonIndexSize;
+        Value * pValBase = moveValOffset + blockno * JacobsonIndexSize;
+        for(bitmap_t w = bitmap[targetSegment][blockno] & moveMask; w != 0; w &= w - 1){
+            Key current_element = *(pKeyBase + wordFirst(w));
             elementCount--;
+            if(j < 0) j = 0;
+            else{
+                type_t keyGap = min((type_t) current_element - lastInsertkey, (type_t) Config::maxGap);
+                j += max((type_t) 1, min(keyGap, lastValidPos - j - elementCount));
+            }
+            *(destKeyOffset + j) = lastInsertkey = current_element;
+            *(destValOffset + j) = *(pValBase + wordFirst(w));
+            blocks[j / JacobsonIndexSize] |= 1ULL << (j % JacobsonIndexSize);
         }
-        lastInput = j;
-        bitmap[targetSegment][blockno] = 0;
+        bitmap[targetSegment][blockno] &= ~moveMask;
+        moveMask = ~0ULL;
     }
 
-    //key_chunks.emplace(key_chunks.begin() + targetSegment + 1, new_key_chunk);
     key_chunks.push_back(new_key_chunk);
-    //value_chunks.emplace(value_chunks.begin() + targetSegment + 1, new_value_chunk);
     value_chunks.push_back(new_value_chunk);
-    //lastElementPos.emplace(lastElementPos.begin() + targetSegment + 1, lastInput);
-    lastElementPos.push_back(lastInput);
-    //lastElementPos[targetSegment] = lastElementTargetSegment;
-    //smallest.emplace(smallest.begin() + targetSegment + 1, *(destKeyOffset));
+    lastElementPos.push_back(j);
     smallest.push_back(*(destKeyOffset));
-    //cardinality.emplace(cardinality.begin() + targetSegment + 1, cardinality[targetSegment] - halfElement);
     cardinality.push_back(cardinality[targetSegment] - halfElement);
     cardinality[targetSegment] = halfElement;
-    //bitmap.emplace(bitmap.begin() + targetSegment + 1, blocks);
-    bitmap.push_back(blocks);
+    addBitmap(blocks);
     totalSegments++;
-    //if(totalSegments<0) {cout<<"GOT TOTAL SEGMENT LESS THAN 0"<<endl; exit(0);}
     return totalSegments-1;
 }
 
-type_t BPlusTree::findCardinality(leaf *l, PMA *obj){
+template <typename Key, typename Value, typename Config>
+type_t BPlusTree<Key, Value, Config>::findCardinality(leaf *l, PMA<Key, Value, Config> *obj){
     type_t total = 0;
     for(int i=0; i<l->childCount; i++){
         total += obj->cardinality[l->segNo[i]];
@@ -1518,7 +3321,8 @@ type_t BPlusTree::findCardinality(leaf *l, PMA *obj){
     return total;
 }
 
-type_t BPlusTree::findCardinality(node *n, PMA *obj){
+template <typename Key, typename Value, typename Config>
+type_t BPlusTree<Key, Value, Config>::findCardinality(node *n, PMA<Key, Value, Config> *obj){
     type_t total = 0;
     for(int i=0; i < n->ptrCount; i++){
         if(n->nodeLeaf) total += findCardinality((leaf *)n->child_ptr[i], obj);
@@ -1527,17 +3331,18 @@ type_t BPlusTree::findCardinality(node *n, PMA *obj){
     return total;
 }
 
-void BPlusTree::printAllElements(PMA *obj){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::printAllElements(PMA<Key, Value, Config> *obj){
     int totalElements = 0;
     leaf *leaf;
     for(leaf = leftmostLeaf(root); leaf != NULL; leaf = leaf->nextLeaf){
         for(int i = 0; i<leaf->childCount; i++){
             int segNo = leaf->segNo[i];
-            type_t *key = obj->key_chunks[segNo];
+            Key *key = obj->key_chunks[segNo];
             type_t pBase = 0;
             for(type_t block = 0; block<obj->blocksInSegment; block++){
                 cout <<" Bitmap: "<<obj->bitmap[segNo][block]<<" ";
-                u_short bitpos = 1;
+                bitmap_t bitpos = 1;
                 for(int j = 0; j<JacobsonIndexSize; j++){
                     if(obj->bitmap[segNo][block] & bitpos)
                         cout << *(key+pBase+j) << " ";
@@ -1554,7 +3359,8 @@ void BPlusTree::printAllElements(PMA *obj){
     cout<<"Total element inserted in the PMA: "<<totalElements<<" Total Segments: "<<obj->totalSegments<<endl;
 }
 
-void BPlusTree::printTree(vector<Node *> nodes, int level){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::printTree(vector<Node *> nodes, int level){
     if(nodes[0] == NULL) return;
     if(nodes[0]->nodeLeaf){ //Create list of leaf child nodes from the current list
         cout<<"Printing level: "<<level<<endl;
@@ -1594,7 +3400,8 @@ void BPlusTree::printTree(vector<Node *> nodes, int level){
     }
 }
 
-void BPlusTree::printTree(vector<Leaf *> nodes, int level){
+template <typename Key, typename Value, typename Config>
+void BPlusTree<Key, Value, Config>::printTree(vector<Leaf *> nodes, int level){
     cout<<"Printing level: "<<level<<endl;
     for(u_int i=0; i<nodes.size(); i++){
         Leaf *temp = nodes[i];
@@ -1606,4 +3413,21 @@ void BPlusTree::printTree(vector<Leaf *> nodes, int level){
         cout<<" || ";
     }
     cout<<endl;
-}
\ No newline at end of file
+}
+//Key and value types, and geometries, the library is built for
+#define INSTANTIATE_PMA(...) template class BPlusTree<__VA_ARGS__>; template class PMA<__VA_ARGS__>;
+INSTANTIATE_PMA(int64_t, int64_t)
+INSTANTIATE_PMA(int32_t, int32_t)
+INSTANTIATE_PMA(int32_t, int64_t)
+INSTANTIATE_PMA(int32_t, Payload<16>)
+INSTANTIATE_PMA(int32_t, Payload<32>)
+INSTANTIATE_PMA(int32_t, Payload<64>)
+INSTANTIATE_PMA(int64_t, Payload<16>)
+INSTANTIATE_PMA(int64_t, Payload<32>)
+INSTANTIATE_PMA(int64_t, Payload<64>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<512>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<2048>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<4096>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<1024, 4, 5>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<1024, 9, 9>)
+INSTANTIATE_PMA(int64_t, int64_t, PMAConfig<1024, Tree_Degree, Leaf_Degree, 1>)
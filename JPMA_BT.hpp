@@ -3,108 +3,354 @@
 
 #include <vector>
 #include <tuple>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <optional>
+#include <limits>
+#include <type_traits>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "defines.hpp"
+#include "WriteAheadLog.hpp"
+#include "SegmentAllocator.hpp"
 //#include "BPlusTree.hpp"
 using namespace std;
 
-class PMA;
+//Occupancy word helpers. Count/first/last map to popcnt/tzcnt/lzcnt, select uses pdep when BMI2 is enabled
+static inline int wordCount(bitmap_t w){ return __builtin_popcountll(w); }
+static inline int wordFirst(bitmap_t w){ return __builtin_ctzll(w); }          //w must not be 0
+static inline int wordLast(bitmap_t w){ return 63 - __builtin_clzll(w); }      //w must not be 0
+static inline int wordSelect(bitmap_t w, int rank){                             //Slot of the rank-th (from 0) set bit
+#ifdef __BMI2__
+    return __builtin_ctzll(_pdep_u64(1ULL << rank, w));
+#else
+    for(int i = 0; i < rank; i++) w &= w - 1;
+    return __builtin_ctzll(w);
+#endif
+}
 
+//Fixed-size value payload, e.g. PMA<int32_t, Payload<32>>. range_sum only sums arithmetic values
+template <int Bytes>
+struct Payload{
+    char bytes[Bytes];
+};
+
+/*
+    Geometry of a PMA: segment and chunk bytes, B+ tree fanout of inner nodes and leaves, and the largest gap
+    left between neighbouring keys when a segment is laid out. The defaults are the values in defines.hpp.
+    PMAs with different geometries can be used side by side, e.g. PMA<int64_t, int64_t, PMAConfig<4096>>.
+    Blocks stay JacobsonIndexSize slots since they are the bitmap words
+ */
+template <int SegmentBytes = SEGMENT_SIZE, int TreeFanout = Tree_Degree, int LeafFanout = Leaf_Degree,
+          int Gap = MaxGap, size_t ChunkBytes = CHUNK_SIZE>
+struct PMAConfig{
+    static constexpr int segmentSize = SegmentBytes;
+    static constexpr size_t chunkSize = ChunkBytes;
+    static constexpr int treeDegree = TreeFanout;
+    static constexpr int leafDegree = LeafFanout;
+    static constexpr int maxGap = Gap;
+
+    static_assert(ChunkBytes % SegmentBytes == 0, "Chunks must hold whole segments");
+    static_assert(TreeFanout >= 3 && LeafFanout >= 3, "Tree nodes need at least 3 children");
+    static_assert(Gap >= 1, "Gap must be at least one slot");
+};
+
+template <typename Key, typename Value, typename Config> class PMA;
+
+template <typename Key = type_t, typename Value = type_t, typename Config = PMAConfig<>>
 class BPlusTree{
 public:
-    typedef struct Leaf{
-        type_t key[Leaf_Degree-1];
-        int segNo[Leaf_Degree];
+    //Separator slots of a leaf and a node, padded to whole SearchGroupSize groups for the vector search.
+    //Both start on a cache line, so a group of 16 keys spans whole lines
+    static constexpr int leafKeySlots = (Config::leafDegree + SearchGroupSize - 2) / SearchGroupSize * SearchGroupSize;
+    static constexpr int nodeKeySlots = (Config::treeDegree + SearchGroupSize - 2) / SearchGroupSize * SearchGroupSize;
+
+    typedef struct alignas(64) Leaf{
+        Key key[leafKeySlots];
+        int segNo[Config::leafDegree];
         char childCount;
         Leaf *nextLeaf;
-        Leaf() : childCount(0), nextLeaf(NULL) {}
+        Leaf() : segNo(), childCount(0), nextLeaf(NULL) {}
     }leaf;
 
     //No node should have a combination of child of leaf and node
-    typedef struct Node{
-        type_t key[Tree_Degree-1];
-        Node *child_ptr[Tree_Degree];
+    typedef struct alignas(64) Node{
+        Key key[nodeKeySlots];
+        Node *child_ptr[Config::treeDegree];
         bool nodeLeaf; //Last non-leaf node has value true
         char ptrCount;
         Node() : ptrCount(0), nodeLeaf(false){}
     }node;
+
+    //Descent recorded by findLeaf. nodes[0] is the root and nodes[depth-1] the node above l.
+    //Splits and merges climb it instead of searching from the root again. Valid until the tree changes shape
+    typedef struct Path{
+        node *nodes[MaxLevel];
+        int depth;
+        leaf *l;
+    }path;
     node *root;
     double level[100];
+    double lowerLevel;                  //Lower density bound of a segment, a sparser one is merged or rebalanced
+    bool deferFree = false;             //Set in concurrent mode: unlinked nodes are kept until releaseRetired since readers may still be on them
+    vector<node *> retiredNodes;
+    vector<leaf *> retiredLeaves;
     //int maxElementInSegment;
 
-    BPlusTree(PMA *obj);
-    leaf* findLeaf(type_t search_key);
-    int searchSegment(type_t search_key);
-    void insertInTree(int chunkNo, type_t search_key, PMA *obj);
-    void reinsertInTree(vector<int> &segments, type_t cardi, PMA *obj);
-    void insert_in_parent(void *left, type_t search_key, void *right, type_t key_for_leaf);
-    node * findParent(void *n, type_t key_parent);
+    BPlusTree(PMA<Key, Value, Config> *obj);
+    leaf* findLeaf(Key search_key);
+    leaf* findLeaf(Key search_key, path &p);
+    int searchSegment(Key search_key);
+    int searchSegment(Key search_key, Key &upperBound);
+    int searchSegment(Key search_key, path &p);
+    void insertInTree(int chunkNo, Key search_key, PMA<Key, Value, Config> *obj);
+    void insertInTree(int chunkNo, Key search_key, PMA<Key, Value, Config> *obj, path &p);
+    void reinsertInTree(vector<int> &segments, type_t cardi, PMA<Key, Value, Config> *obj);
+    void buildFromSegments(vector<int> &segments, PMA<Key, Value, Config> *obj);
+    void insert_in_parent(void *left, Key search_key, void *right, path &p, int depth);
 
     void calculateThreshold();
     void listSegments(vector<int> &segments, node *parent);
-    type_t findCardinality(BPlusTree::leaf *l, PMA *obj);
-    type_t findCardinality(BPlusTree::node *n, PMA *obj);
-    void redistributeInsert(int segment, type_t Skey, PMA *obj);
+    type_t findCardinality(leaf *l, PMA<Key, Value, Config> *obj);
+    type_t findCardinality(node *n, PMA<Key, Value, Config> *obj);
+    void redistributeInsert(int segment, Key Skey, PMA<Key, Value, Config> *obj, path &p);
+    void redistributeRemove(int segment, Key SKey, PMA<Key, Value, Config> *obj, path &p);
+    void renumberSegment(int from, int to, PMA<Key, Value, Config> *obj);
+    void replaceSeparator(Key oldKey, Key newKey);
+    void removeLeaf(leaf *l, leaf *prev, Key bound, path &p);
+    void removeChild(void *child, Key bound, path &p, int depth);
+    Key relabel(leaf *l, PMA<Key, Value, Config> *obj);
+    Key relabel(node *n, PMA<Key, Value, Config> *obj);
 
     leaf* leftmostLeaf(node *root);
     leaf* rightmostLeaf(node *root);
     void deleteNode(node *parent);
-    void deleteLeaf(leaf *l, type_t SKey);
-    void printAllElements(PMA *obj);
+    void freeNode(node *n);
+    void freeLeaf(leaf *l);
+    void releaseRetired();
+    void saveNode(node *n, vector<char> &out);
+    node* loadNode(const char *&in, const char *end, int segments, leaf *&prev, int depth);
+    void printAllElements(PMA<Key, Value, Config> *obj);
     void printTree(vector<Node *> nodes, int level);
     void printTree(vector<Leaf *> nodes, int level);
 };
 
+template <typename Key = type_t, typename Value = type_t, typename Config = PMAConfig<>>
 class PMA{
 public:
-    vector<type_t *> key_chunks;
-    vector<type_t *> value_chunks;
-    vector<type_t> smallest;
+    static_assert(is_integral<Key>::value, "Keys must be integers");
+    static constexpr int elementsInSegment = Config::segmentSize / sizeof(Key);
+    static constexpr type_t blocksInSegment = elementsInSegment / JacobsonIndexSize;
+    static constexpr type_t lastValidPos = elementsInSegment - 1;      //Last accessible slot in each segment
+    static_assert(elementsInSegment % JacobsonIndexSize == 0, "Segments must hold whole blocks");
+    typedef BPlusTree<Key, Value, Config> tree_t;
+
+    //Occupied slots of one block handed out by Cursor::nextSpan. Every set bit j of bits is an element at keys[j]
+    typedef struct Span{
+        const Key *keys;
+        Value *values;
+        bitmap_t bits;
+    }span;
+
+    //Forward cursor in key order. Follows the leaf chain and points into the segments without copying
+    class Cursor{
+    public:
+        Cursor() : pma(NULL), l(NULL), child(0), segNo(0), block(0), rest(0), keyBase(NULL), valueBase(NULL), ahead(NULL) {}
+        bool valid() const { return l != NULL; }
+        const Key *key() const { return keyBase + wordFirst(rest); }
+        Value *value() const { return valueBase + wordFirst(rest); }
+        bool next();
+        bool nextSpan(span &s);
+    private:
+        friend class PMA;
+        PMA *pma;
+        typename tree_t::leaf *l;
+        int child;
+        int segNo;
+        type_t block;
+        bitmap_t rest;                  //Slots of the current block not handed out yet
+        Key *keyBase;
+        Value *valueBase;
+        typename tree_t::leaf *ahead;   //Last leaf read ahead with Allocation_type 3
+        bool settle();
+    };
+
+    vector<Key *> key_chunks;
+    vector<Value *> value_chunks;
+    vector<Key> smallest;
     vector<type_t> lastElementPos;
     vector<int> cardinality;
     int totalSegments;
-    int elementsInSegment;
-    u_char NonZeroEntries[JacobsonIndexCount][JacobsonIndexSize+1];
-    vector<vector<u_short>> bitmap;
-    BPlusTree *tree;
-    type_t lastValidPos;             //Last accessible slot in each segment
+    vector<vector<bitmap_t>> bitmap;
+    tree_t *tree;
     int freeSegmentCount;
-    type_t blocksInSegment;
-    vector<type_t *> freeKeySegmentBuffer;
-    vector<type_t *> freeValueSegmentBuffer;
-    int redisInsCount = 0, redisUpCount = 0;
-    vector<type_t *> cleanSegments;
+    vector<vector<Key *>> freeKeySegmentBuffer;      //Free segments, one pool per NUMA node
+    vector<vector<Value *>> freeValueSegmentBuffer;
+    int redisInsCount = 0, redisUpCount = 0, redisRemCount = 0;
+    //One allocation of Config::chunkSize key bytes and its value chunk, carved into segments by getSegment.
+    //live counts the segments handed out of it, shrink_to_fit releases chunks that run mostly empty.
+    //mapped chunks are pages of a snapshot file mapped by open, fileOffset is the place of a chunk in
+    //the segment file with Allocation_type 3 and -1 otherwise. node is the NUMA node whose pool it feeds,
+    //source the allocator that returned it (NULL for mapped and file chunks)
+    typedef struct Chunk{
+        Key *keys;
+        Value *values;
+        int live;
+        bool mapped;
+        int64_t fileOffset;
+        int node;
+        SegmentAllocator *source;
+    }chunk;
+    static constexpr int segmentsInChunk = Config::chunkSize / Config::segmentSize;
+    vector<chunk> chunks;               //Sorted by address
+    vector<chunk> retiredChunks;        //Released in concurrent mode, unmapped by disableConcurrency
+    int segmentFile = -1;               //Allocation_type 3: the file, its length and the offsets of released chunks
+    int64_t segmentFileBytes = 0;
+    vector<int64_t> freeFileOffsets;
+    vector<SegmentAllocator *> allocators;  //Set by set_allocators, else the Allocation_type chain on the first chunk
+    thread shrinker;                    //Background shrink_to_fit in concurrent mode
+    mutex shrinkerLock;
+    atomic<bool> shrinking{false};
+    vector<int> spreadSegments;      //Segments added by the last BPlusTree::reinsertInTree
+    typename tree_t::path writePath; //Descent of the last beginWrite, single-threaded mode only
+    WriteAheadLog *wal = NULL;       //Set by enable_log
+
+    //NUMA placement (numa_placement). New chunks are bound to the node their segments are placed on.
+    //Scans count the segments they read on the scanning thread's node and on other nodes
+    enum { NumaFirstTouch, NumaInterleave, NumaKeyRange };
+    int numaPolicy = NumaFirstTouch;
+    Key numaLow = 0, numaHigh = 0;
+    int numaNext = 0;
+    atomic<uint64_t> localAccesses{0}, remoteAccesses{0};
+
+    //Concurrent mode (enableConcurrency). A version word is even while free and odd while a writer holds it.
+    //treeVersion is held while tree nodes are changed, segmentVersion[i] guards the contents of segment i.
+    //Splits, merges and shrink_to_fit are serialized by layoutLock, which readers never take
+    bool concurrent = false;
+    int maxSegments = 0;
+    atomic<uint64_t> treeVersion{0};
+    atomic<uint64_t> *segmentVersion = NULL;
+    mutex layoutLock;
 
     PMA();
+    PMA(const Key *sortedKeys, const Value *values, size_t n);
     ~PMA();
 
     //Library functions
-    bool insert(type_t key, type_t value, int count= 0);
-    bool remove(type_t key);
-    bool lookup(type_t key);
-    tuple<type_t, type_t> range_sum(type_t startKey, type_t endKey);
+    bool insert(Key key, Value value, int count= 0);
+    size_t insert_batch(const Key *keys, const Value *values, size_t n);
+    void bulk_load(const Key *sortedKeys, const Value *values, size_t n);
+    bool remove(Key key);
+    bool lookup(Key key);
+    size_t lookup_batch(const Key *keys, size_t n, Value *outValues, bool *found);
+    optional<Value> get(Key key);
+    bool upsert(Key key, Value value);
+    size_t write_batch(const Key *keys, const Value *values, const bool *removes, size_t n, bool *results);
+    template <typename F> bool update(Key key, F fn);
+    tuple<type_t, type_t> range_sum(Key startKey, Key endKey);
+    tuple<type_t, type_t> range_sum_parallel(Key startKey, Key endKey, int threads);
+    vector<tuple<Key, Key>> partition_range(Key startKey, Key endKey, int pieces);
+    Cursor seek(Key key);
+    size_t shrink_to_fit();
+    void numa_placement(int policy, Key minKey = 0, Key maxKey = 0);
+    void set_allocators(const vector<SegmentAllocator *> &chain);
+    bool save(const char *path);
+    bool open(const char *path);
+    bool enable_log(const char *path, int mode, bool truncate = false);
+    void disable_log();
+    int64_t replay_log(const char *path);
+    void enableConcurrency(int maxSegments);
+    void disableConcurrency();
 
     //Support functions
-    int searchSegment(type_t key);
-    tuple<type_t *, type_t *> getSegment();
-    void preCalculateJacobson();
-    void insertInPosition(type_t position, int targetSegment, type_t key, type_t value);
-    bool backSearchInsert(type_t position, type_t key, type_t value, int targetSegment, int count);
-    bool insertForward(type_t position, type_t key, type_t value, int targetSegment, int count); //Extra
-    bool insertBackward(type_t position, type_t key, type_t value, int targetSegment, int count); //Extra
-    bool insertAfterLast(type_t position, type_t key, type_t value, int targetSegment, type_t foundKey, int count);
-    void deleteInPosition(type_t position, int targetSegment, type_t key);
+    int searchSegment(Key key);
+    tuple<Key *, Value *> getSegment(int node = 0);
+    int placeNode(Key key);
+    int segmentNode(int targetSegment);
+    int chunkOf(const Key *segment);
+    chunk mapFileChunk();
+    void adviseSegment(int targetSegment, int advice);
+    void adviseLeaf(typename tree_t::leaf *l, int advice);
+    typename tree_t::leaf *adviseAhead(typename tree_t::leaf *ahead, typename tree_t::leaf *l);
+    void adviseChunks(int advice);
+    void releaseChunk(chunk &c);
+    bool shrinkDue();
+    bool insertInSegment(int targetSegment, type_t position, Key key, Value value, int count);
+    int beginWrite(Key key);
+    void endWrite(int targetSegment, bool removed = false);
+    uint64_t logWrite(char op, Key key, const Value *value);
+    void logCommit(uint64_t position);
+    Value *acquireValue(Key key, int &targetSegment);
+    void releaseValue(int targetSegment);
+    bool sumSegment(int targetSegment, type_t position, Key startKey, Key endKey, type_t &sum_key, type_t &sum_value);
+    void prefetchSegment(int targetSegment);
+    bool lowestKey(int targetSegment, Key &key);
+    void coveredSegments(Key startKey, Key endKey, vector<int> &segments);
+    void partitionSegments(Key startKey, Key endKey, int pieces, vector<int> &segments, vector<size_t> &cuts);
+    void partitionConcurrent(Key startKey, Key endKey, int pieces, vector<Key> &bounds);
+    type_t nextFreeSlot(int targetSegment, type_t position);
+    type_t prevFreeSlot(int targetSegment, type_t position);
+    type_t lastOccupiedSlot(int targetSegment);
+    bool isOccupied(int targetSegment, type_t position);
+    void insertInPosition(type_t position, int targetSegment, Key key, Value value);
+    bool backSearchInsert(type_t position, Key key, Value value, int targetSegment, int count);
+    bool insertForward(type_t position, Key key, Value value, int targetSegment, int count); //Extra
+    bool insertBackward(type_t position, Key key, Value value, int targetSegment, int count); //Extra
+    bool insertAfterLast(type_t position, Key key, Value value, int targetSegment, Key foundKey, int count);
+    size_t mergeIntoSegment(int targetSegment, const Key *keys, const Value *values, size_t count);
+    void layoutSegment(int targetSegment, const Key *keys, const Value *values, type_t count);
+    void deleteInPosition(type_t position, int targetSegment, Key key);
     void deleteSegment(int targetSegment);
-    type_t findLocation(type_t key, int targetSegment);
-    type_t findLocation1(type_t key, int targetSegment);
-    type_t findLocation2(type_t key, int targetSegment);
+    void addBitmap(const vector<bitmap_t> &blocks);
+    void rebalancePair(int left, int right, bool merge);
+    type_t findLocation(Key key, int targetSegment);
+    type_t findLocation1(Key key, int targetSegment);
+    type_t findLocationBlock(Key key, int targetSegment);
     int redistributeWithDividing(int targetSegment);
     void swapElements(type_t targetSegment, type_t position, type_t adjust);
 
+    //Concurrency support functions
+    optional<Value> getConcurrent(Key key);
+    tuple<type_t, type_t> rangeSumConcurrent(Key startKey, Key endKey);
+    tuple<type_t, type_t> rangeSumParallelConcurrent(Key startKey, Key endKey, int threads);
+    void splitConcurrent(int targetSegment);
+    void mergeConcurrent(int targetSegment);
+    void startShrink();
+    uint64_t readVersion(atomic<uint64_t> &version);
+    bool validateVersion(atomic<uint64_t> &version, uint64_t seen);
+    void lockVersion(atomic<uint64_t> &version);
+    void unlockVersion(atomic<uint64_t> &version);
+    void lockSegments(vector<int> &segments, int held);
+    void unlockSegments(vector<int> &segments, int held);
+    void lockTree();
+    void unlockTree();
+
     //Testing functions
     void printStat();
     void printAllElements();
     void printSegElements(int targetSegment);
 };
 
+/*
+    Replaces the value of key with fn(value) in place. Returns false if key is not present
+ */
+template <typename Key, typename Value, typename Config>
+template <typename F>
+bool PMA<Key, Value, Config>::update(Key key, F fn){
+    int targetSegment;
+    uint64_t logged = 0;
+    Value *value = acquireValue(key, targetSegment);
+    if(value != NULL){
+        *value = fn(*value);
+        logged = logWrite(WriteAheadLog::RecordUpsert, key, value);
+    }
+    releaseValue(targetSegment);
+    logCommit(logged);
+    return value != NULL;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <sys/mman.h>
+
+#include "defines.hpp"
+#include "SegmentAllocator.hpp"
+#include "jemalloc.h"
+
+using namespace std;
+
+static inline size_t hugeRound(size_t bytes){
+    return (bytes + HugePageBytes - 1) / HugePageBytes * HugePageBytes;
+}
+
+void *HugeTLBAllocator::allocate(size_t bytes){
+#ifdef MAP_HUGETLB
+    void *p = mmap(NULL, hugeRound(bytes), PROTECTION, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    return NULL;
+#endif
+}
+
+void HugeTLBAllocator::release(void *p, size_t bytes){
+    munmap(p, hugeRound(bytes));
+}
+
+/*
+    Maps HugePageBytes more than asked for and trims the ends, which leaves the block on a huge page boundary
+ */
+void *TransparentHugeAllocator::allocate(size_t bytes){
+    size_t length = hugeRound(bytes);
+    char *p = (char *)mmap(NULL, length + HugePageBytes, PROTECTION, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)p + HugePageBytes - 1) / HugePageBytes * HugePageBytes);
+    if(aligned > p) munmap(p, aligned - p);
+    munmap(aligned + length, p + HugePageBytes - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+void TransparentHugeAllocator::release(void *p, size_t bytes){
+    munmap(p, hugeRound(bytes));
+}
+
+JemallocAllocator::JemallocAllocator(){
+    unsigned arena;
+    size_t length = sizeof(arena);
+    flags = MALLOCX_ALIGN(HugePageBytes) | MALLOCX_TCACHE_NONE;
+    if(je_mallctl("arenas.create", &arena, &length, NULL, 0) == 0) flags |= MALLOCX_ARENA(arena);
+}
+
+void *JemallocAllocator::allocate(size_t bytes){
+    return je_mallocx(bytes, flags);
+}
+
+void JemallocAllocator::release(void *p, size_t bytes){
+    je_sdallocx(p, bytes, flags);
+}
+
+void *PmrAllocator::allocate(size_t bytes){
+    lock_guard<mutex> guard(lock);
+    try{
+        return resource->allocate(bytes, alignment);
+    }catch(const bad_alloc &){
+        return NULL;
+    }
+}
+
+void PmrAllocator::release(void *p, size_t bytes){
+    lock_guard<mutex> guard(lock);
+    resource->deallocate(p, bytes, alignment);
+}
+
+SegmentAllocator *SegmentAllocator::hugeTLB(){
+    static HugeTLBAllocator allocator;
+    return &allocator;
+}
+
+SegmentAllocator *SegmentAllocator::transparentHuge(){
+    static TransparentHugeAllocator allocator;
+    return &allocator;
+}
+
+SegmentAllocator *SegmentAllocator::jemalloc(){
+    static JemallocAllocator allocator;
+    return &allocator;
+}
+
+vector<SegmentAllocator *> SegmentAllocator::chain(int allocationType){
+    if(allocationType == 1) return {hugeTLB(), transparentHuge(), jemalloc()};
+    if(allocationType == 4) return {transparentHuge(), jemalloc()};
+    return {jemalloc()};
+}
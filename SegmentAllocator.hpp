@@ -0,0 +1,76 @@
+#ifndef SEGMENT_ALLOCATOR_HPP_
+#define SEGMENT_ALLOCATOR_HPP_
+
+#include <vector>
+#include <mutex>
+#include <cstddef>
+#include <memory_resource>
+
+#include "defines.hpp"
+using namespace std;
+
+/*
+    Source of the chunk memory of a PMA. allocate returns NULL when it cannot serve a request, the PMA
+    then tries the next allocator of its chain (PMA::set_allocators) instead of giving up. A chunk is
+    released to the allocator that returned it. Allocators must outlive the PMAs using them
+ */
+class SegmentAllocator{
+public:
+    virtual ~SegmentAllocator() {}
+    virtual void *allocate(size_t bytes) = 0;
+    virtual void release(void *p, size_t bytes) = 0;
+    virtual const char *name() const = 0;
+
+    //Shared instances of the built-in allocators
+    static SegmentAllocator *hugeTLB();
+    static SegmentAllocator *transparentHuge();
+    static SegmentAllocator *jemalloc();
+    //Chain for an Allocation_type: 1 hugetlb, then transparent huge pages, then jemalloc. 2 jemalloc.
+    //4 transparent huge pages, then jemalloc
+    static vector<SegmentAllocator *> chain(int allocationType);
+};
+
+//Huge pages reserved in the hugetlbfs pool (MAP_HUGETLB). Fails when the pool is empty or not set up
+class HugeTLBAllocator : public SegmentAllocator{
+public:
+    void *allocate(size_t bytes);
+    void release(void *p, size_t bytes);
+    const char *name() const { return "hugetlb"; }
+};
+
+//Anonymous memory aligned to HugePageBytes and marked MADV_HUGEPAGE, so the kernel can back it with
+//transparent huge pages without a reserved pool
+class TransparentHugeAllocator : public SegmentAllocator{
+public:
+    void *allocate(size_t bytes);
+    void release(void *p, size_t bytes);
+    const char *name() const { return "transparent huge pages"; }
+};
+
+//A jemalloc arena of its own, so chunks do not share extents with the rest of the heap.
+//Uses the default arenas if one cannot be created
+class JemallocAllocator : public SegmentAllocator{
+public:
+    JemallocAllocator();
+    void *allocate(size_t bytes);
+    void release(void *p, size_t bytes);
+    const char *name() const { return "jemalloc"; }
+private:
+    int flags;
+};
+
+//Any std::pmr::memory_resource, e.g. a pool or a monotonic buffer over preallocated memory.
+//Calls are serialized since memory resources need not be thread-safe
+class PmrAllocator : public SegmentAllocator{
+public:
+    PmrAllocator(pmr::memory_resource *resource, size_t alignment = HugePageBytes) : resource(resource), alignment(alignment) {}
+    void *allocate(size_t bytes);
+    void release(void *p, size_t bytes);
+    const char *name() const { return "pmr"; }
+private:
+    pmr::memory_resource *resource;
+    size_t alignment;
+    mutex lock;
+};
+
+#endif
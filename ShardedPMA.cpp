@@ -0,0 +1,241 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "defines.hpp"
+#include "ShardedPMA.hpp"
+
+using namespace std;
+
+//Spins for a while before yielding, so idle workers do not starve the front end on a busy machine
+static inline void backoff(int &spins){
+    if(++spins < 64) _mm_pause();
+    else{
+        spins = 0;
+        this_thread::yield();
+    }
+}
+
+bool ShardedPMA::RequestQueue::push(const request &r){
+    uint64_t t = tail.load(memory_order_relaxed);
+    if(t - head.load(memory_order_acquire) == ShardQueueSize) return false;
+    slots[t % ShardQueueSize] = r;
+    tail.store(t + 1, memory_order_release);
+    return true;
+}
+
+bool ShardedPMA::RequestQueue::pop(request &r){
+    uint64_t h = head.load(memory_order_relaxed);
+    if(h == tail.load(memory_order_acquire)) return false;
+    r = slots[h % ShardQueueSize];
+    head.store(h + 1, memory_order_release);
+    return true;
+}
+
+/*
+    Starts shardCount shards splitting [minKey, maxKey] into equal ranges.
+    Keys outside the range go to the first or the last shard
+ */
+ShardedPMA::ShardedPMA(int shardCount, type_t minKey, type_t maxKey){
+    if(shardCount < 1 || shardCount > ShardMaxCount || maxKey < minKey){
+        cout<<"Invalid sharding: "<<shardCount<<" shards over ["<<minKey<<", "<<maxKey<<"]"<<endl;
+        exit(0);
+    }
+    type_t width = (maxKey - minKey) / shardCount + 1;
+    for(int i = 0; i<shardCount; i++){
+        lowerBound.push_back(i == 0 ? INT64_MIN : minKey + i * width);
+        shards.push_back(startShard(new PMA<>(), 0, i));
+    }
+}
+
+ShardedPMA::~ShardedPMA(){
+    for(u_int i = 0; i<shards.size(); i++){
+        stopShard(shards[i]);
+        delete shards[i]->pma;
+        delete shards[i];
+    }
+}
+
+ShardedPMA::shard *ShardedPMA::startShard(PMA<> *pma, type_t size, int cpu){
+    shard *s = new shard();
+    s->pma = pma;
+    s->size.store(size, memory_order_relaxed);
+    s->cpu = cpu % max(1u, thread::hardware_concurrency());
+    s->worker = thread(work, s);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(s->cpu, &cpus);
+    pthread_setaffinity_np(s->worker.native_handle(), sizeof(cpu_set_t), &cpus);
+    return s;
+}
+
+void ShardedPMA::stopShard(shard *s){
+    request r = {OpStop, 0, 0, NULL};
+    int spins = 0;
+    while(!s->queue.push(r)) backoff(spins);
+    s->worker.join();
+}
+
+/*
+    Worker loop of one shard. The PMA is only touched from here while the shard runs
+ */
+void ShardedPMA::work(shard *s){
+    request r;
+    int spins = 0;
+    while(true){
+        if(!s->queue.pop(r)){
+            backoff(spins);
+            continue;
+        }
+        spins = 0;
+        switch(r.op){
+            case OpInsert:
+                if(s->pma->insert(r.key, r.value)) s->size.store(s->size.load(memory_order_relaxed) + 1, memory_order_relaxed);
+                break;
+            case OpRemove:
+                if(s->pma->remove(r.key)) s->size.store(s->size.load(memory_order_relaxed) - 1, memory_order_relaxed);
+                break;
+            case OpLookup:
+                r.res->found = s->pma->lookup(r.key);
+                break;
+            case OpRangeSum:
+                tie(r.res->sum_key, r.res->sum_value) = s->pma->range_sum(r.key, r.value);
+                break;
+            case OpSync:
+                break;
+            case OpStop:
+                return;
+        }
+        if(r.res != NULL) r.res->done.store(true, memory_order_release);
+    }
+}
+
+int ShardedPMA::findShard(type_t key){
+    return upper_bound(lowerBound.begin(), lowerBound.end(), key) - lowerBound.begin() - 1;
+}
+
+void ShardedPMA::submit(int shardNo, const request &r){
+    push(shardNo, r);
+    if(UNLIKELY(++submitted % ShardCheckInterval == 0)) checkBalance();
+}
+
+//Queues r without counting it towards the balance check, which could split shards under the caller
+void ShardedPMA::push(int shardNo, const request &r){
+    int spins = 0;
+    while(!shards[shardNo]->queue.push(r)) backoff(spins);
+}
+
+void ShardedPMA::wait(result &r){
+    int spins = 0;
+    while(!r.done.load(memory_order_acquire)) backoff(spins);
+}
+
+/*
+    Returns once every request queued so far on the shard is done
+ */
+void ShardedPMA::drain(int shardNo){
+    result res;
+    request r = {OpSync, 0, 0, &res};
+    push(shardNo, r);
+    wait(res);
+}
+
+void ShardedPMA::insert(type_t key, type_t value){
+    request r = {OpInsert, key, value, NULL};
+    submit(findShard(key), r);
+}
+
+void ShardedPMA::remove(type_t key){
+    request r = {OpRemove, key, 0, NULL};
+    submit(findShard(key), r);
+}
+
+bool ShardedPMA::lookup(type_t key){
+    result res;
+    request r = {OpLookup, key, 0, &res};
+    submit(findShard(key), r);
+    wait(res);
+    return res.found;
+}
+
+/*
+    Sends the range to every shard it overlaps, clipped to the shard, and adds up the partial sums.
+    Shards are only rebalanced once all partial sums are in, a split during the fan-out would shift
+    the shard numbers still to be visited
+ */
+tuple<type_t, type_t> ShardedPMA::range_sum(type_t startKey, type_t endKey){
+    if(startKey > endKey) return {0, 0};
+    int first = findShard(startKey), last = findShard(endKey);
+    vector<result> partial(last - first + 1);
+    for(int i = first; i<=last; i++){
+        type_t from = max(startKey, lowerBound[i]);
+        type_t to = (i + 1 < (int)lowerBound.size()) ? min(endKey, lowerBound[i+1] - 1) : endKey;
+        request r = {OpRangeSum, from, to, &partial[i - first]};
+        push(i, r);
+    }
+    type_t sum_key = 0, sum_value = 0;
+    for(u_int i = 0; i<partial.size(); i++){
+        wait(partial[i]);
+        sum_key += partial[i].sum_key;
+        sum_value += partial[i].sum_value;
+    }
+    type_t before = submitted;
+    submitted += partial.size();
+    if(UNLIKELY(submitted / ShardCheckInterval != before / ShardCheckInterval)) checkBalance();
+    return {sum_key, sum_value};
+}
+
+void ShardedPMA::flush(){
+    for(u_int i = 0; i<shards.size(); i++) drain(i);
+}
+
+/*
+    Splits the largest shard when it holds far more than the average one
+ */
+void ShardedPMA::checkBalance(){
+    if(shards.size() >= ShardMaxCount) return;
+    type_t total = 0, largest = 0;
+    int largestShard = 0;
+    for(u_int i = 0; i<shards.size(); i++){
+        type_t size = shards[i]->size.load(memory_order_relaxed);
+        total += size;
+        if(size > largest){
+            largest = size;
+            largestShard = i;
+        }
+    }
+    if(largest < ShardMinSplit || largest * (type_t)shards.size() <= ShardSplitFactor * total) return;
+    splitShard(largestShard);
+}
+
+/*
+    Waits for the shard to go idle, rebuilds its lower half in place and moves the upper half
+    to a new shard right after it. Both halves are bulk-loaded from a cursor scan
+ */
+void ShardedPMA::splitShard(int shardNo){
+    drain(shardNo);
+    shard *s = shards[shardNo];
+    vector<type_t> keys, values;
+    keys.reserve(s->size.load(memory_order_relaxed));
+    values.reserve(s->size.load(memory_order_relaxed));
+    for(PMA<>::Cursor c = s->pma->seek(INT64_MIN); c.valid(); c.next()){
+        keys.push_back(*c.key());
+        values.push_back(*c.value());
+    }
+    if(keys.size() < 2) return;
+
+    size_t half = keys.size() / 2;
+    PMA<> *lower = new PMA<>(&keys[0], &values[0], half);
+    PMA<> *upper = new PMA<>(&keys[half], &values[half], keys.size() - half);
+    delete s->pma;
+    //The worker is idle and picks the new PMA up with its next request
+    s->pma = lower;
+    s->size.store(half, memory_order_relaxed);
+
+    shards.insert(shards.begin() + shardNo + 1, startShard(upper, keys.size() - half, shards.size()));
+    lowerBound.insert(lowerBound.begin() + shardNo + 1, keys[half]);
+    shardSplits++;
+}
@@ -0,0 +1,86 @@
+#ifndef SHARDED_PMA_HPP_
+#define SHARDED_PMA_HPP_
+
+#include <vector>
+#include <tuple>
+#include <atomic>
+#include <thread>
+
+#include "defines.hpp"
+#include "JPMA_BT.hpp"
+using namespace std;
+
+/*
+    Shared-nothing front end over several PMAs, each owning a key range. Every shard has its own
+    worker thread (pinned to a core) that drains a single-producer single-consumer request queue,
+    so the PMAs themselves run single-threaded. All calls must come from one front-end thread.
+    insert and remove are asynchronous, later requests to the same shard observe them
+ */
+class ShardedPMA{
+public:
+    enum { OpInsert, OpRemove, OpLookup, OpRangeSum, OpSync, OpStop };
+
+    //Filled by the worker, done is set last
+    typedef struct Result{
+        atomic<bool> done;
+        bool found;
+        type_t sum_key, sum_value;
+        Result() : done(false), found(false), sum_key(0), sum_value(0) {}
+    }result;
+
+    typedef struct Request{
+        char op;
+        type_t key;
+        type_t value;                    //End key for OpRangeSum
+        result *res;                     //NULL for insert and remove
+    }request;
+
+    //Bounded ring buffer. Only the front end pushes and only the shard worker pops
+    class RequestQueue{
+    public:
+        RequestQueue() : head(0), tail(0) {}
+        bool push(const request &r);
+        bool pop(request &r);
+    private:
+        alignas(64) atomic<uint64_t> head;  //Next slot to pop
+        alignas(64) atomic<uint64_t> tail;  //Next slot to push
+        alignas(64) request slots[ShardQueueSize];
+    };
+
+    typedef struct Shard{
+        PMA<> *pma;
+        RequestQueue queue;
+        thread worker;
+        atomic<type_t> size;             //Elements in pma, kept by the worker
+        int cpu;
+    }shard;
+
+    vector<shard *> shards;              //In key order
+    vector<type_t> lowerBound;           //Smallest key routed to each shard (the first one takes everything below)
+    type_t submitted = 0;
+    int shardSplits = 0;
+
+    ShardedPMA(int shardCount, type_t minKey, type_t maxKey);
+    ~ShardedPMA();
+
+    //Library functions
+    void insert(type_t key, type_t value);
+    void remove(type_t key);
+    bool lookup(type_t key);
+    tuple<type_t, type_t> range_sum(type_t startKey, type_t endKey);
+    void flush();
+
+    //Support functions
+    int findShard(type_t key);
+    void submit(int shardNo, const request &r);
+    void push(int shardNo, const request &r);
+    void wait(result &r);
+    void drain(int shardNo);
+    shard *startShard(PMA<> *pma, type_t size, int cpu);
+    void stopShard(shard *s);
+    static void work(shard *s);
+    void checkBalance();
+    void splitShard(int shardNo);
+};
+
+#endif
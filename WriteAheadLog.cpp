@@ -0,0 +1,142 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "defines.hpp"
+#include "WriteAheadLog.hpp"
+
+using namespace std;
+
+WriteAheadLog::WriteAheadLog(int mode, uint32_t keyBytes, uint32_t valueBytes) : mode(mode), keyBytes(keyBytes), valueBytes(valueBytes){
+}
+
+/*
+    Makes everything appended durable, then stops the commit thread
+ */
+WriteAheadLog::~WriteAheadLog(){
+    if(fd < 0) return;
+    {
+        lock_guard<mutex> guard(logLock);
+        stopping = true;
+    }
+    pendingReady.notify_one();
+    committer.join();
+    close(fd);
+}
+
+/*
+    Opens the log at path and starts the commit thread. An existing log is continued after its last complete
+    record unless truncate is set, a log written for other key or value sizes is refused
+ */
+bool WriteAheadLog::start(const char *path, bool truncate){
+    uint64_t validBytes = 0;
+    struct stat existing;
+    //A missing or empty file is started like a new log
+    if(!truncate && stat(path, &existing) == 0 && existing.st_size > 0){
+        if(scan(path, keyBytes, valueBytes, [](char, const char *, const char *){}, validBytes) < 0){
+            cout<<"Cannot continue log "<<path<<": not a log for this PMA"<<endl;
+            return false;
+        }
+    }
+    fd = ::open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if(fd < 0 || ftruncate(fd, validBytes) != 0 || lseek(fd, validBytes, SEEK_SET) < 0){
+        cout<<"Cannot open log "<<path<<": "<<strerror(errno)<<endl;
+        if(fd >= 0) close(fd);
+        fd = -1;
+        return false;
+    }
+    if(validBytes == 0){
+        header h;
+        memcpy(h.magic, LogMagic, sizeof(LogMagic));
+        h.keyBytes = keyBytes;
+        h.valueBytes = valueBytes;
+        pending.insert(pending.end(), (const char *)&h, (const char *)(&h + 1));
+    }
+    committer = thread(&WriteAheadLog::commit, this);
+    return true;
+}
+
+/*
+    Queues one record and returns the log position after it, for waitDurable
+ */
+uint64_t WriteAheadLog::append(char op, const void *key, const void *value){
+    bool wake;
+    uint64_t position;
+    {
+        lock_guard<mutex> guard(logLock);
+        pending.push_back(op);
+        pending.insert(pending.end(), (const char *)key, (const char *)key + keyBytes);
+        if(value != NULL) pending.insert(pending.end(), (const char *)value, (const char *)value + valueBytes);
+        appended += 1 + keyBytes + (value != NULL ? valueBytes : 0);
+        position = appended;
+        records++;
+        wake = mode == LogSync || pending.size() >= LogFlushBytes;
+    }
+    if(wake) pendingReady.notify_one();
+    return position;
+}
+
+//In sync mode, blocks until the log is durable up to position
+void WriteAheadLog::waitDurable(uint64_t position){
+    if(mode != LogSync) return;
+    unique_lock<mutex> lock(logLock);
+    durableReady.wait(lock, [this, position]{ return durable >= position; });
+}
+
+//Blocks until everything appended so far is durable, in either mode
+void WriteAheadLog::flush(){
+    unique_lock<mutex> lock(logLock);
+    uint64_t position = appended;
+    flushTo = position;
+    pendingReady.notify_one();
+    durableReady.wait(lock, [this, position]{ return durable >= position; });
+}
+
+/*
+    Commit thread. Takes everything pending as one group, writes and syncs it outside the lock and
+    wakes the writers it covers. Records appended meanwhile form the next group
+ */
+void WriteAheadLog::commit(){
+    vector<char> group;
+    unique_lock<mutex> lock(logLock);
+    while(true){
+        if(mode == LogSync) pendingReady.wait(lock, [this]{ return !pending.empty() || stopping; });
+        else pendingReady.wait_for(lock, chrono::milliseconds(LogSyncInterval), [this]{
+            return pending.size() >= LogFlushBytes || durable < flushTo || stopping;
+        });
+        if(pending.empty()){
+            durable = appended;
+            durableReady.notify_all();
+            if(stopping) return;
+            continue;
+        }
+        group.swap(pending);
+        uint64_t upTo = appended;
+        lock.unlock();
+
+        size_t done = 0;
+        while(done < group.size()){
+            ssize_t n = write(fd, &group[done], group.size() - done);
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0){
+                cout<<"Cannot write the log: "<<strerror(errno)<<endl;
+                exit(0);
+            }
+            done += n;
+        }
+        if(fdatasync(fd) != 0){
+            cout<<"Cannot sync the log: "<<strerror(errno)<<endl;
+            exit(0);
+        }
+        group.clear();
+
+        lock.lock();
+        syncs++;
+        durable = upTo;
+        durableReady.notify_all();
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef WRITE_AHEAD_LOG_HPP_
+#define WRITE_AHEAD_LOG_HPP_
+
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "defines.hpp"
+using namespace std;
+
+/*
+    Append-only log of PMA writes. A record is an op byte, the key and, for inserts and upserts, the value,
+    all in the byte layout of the PMA's Key and Value. Writers append under a mutex and get the log position
+    after their record. A commit thread writes out everything appended so far and syncs it with one fdatasync,
+    so writers waiting in sync mode share the sync of their group. In async mode writers never wait and the
+    log is synced every LogSyncInterval milliseconds or once LogFlushBytes are pending
+ */
+class WriteAheadLog{
+public:
+    enum { LogAsync = 1, LogSync = 2 };
+    enum { RecordInsert = 1, RecordRemove = 2, RecordUpsert = 3 };
+
+    //First bytes of a log file. Records follow it back to back
+    typedef struct Header{
+        char magic[8];
+        uint32_t keyBytes, valueBytes;
+    }header;
+
+    int mode;
+    uint32_t keyBytes, valueBytes;
+    uint64_t records = 0, syncs = 0;
+
+    WriteAheadLog(int mode, uint32_t keyBytes, uint32_t valueBytes);
+    ~WriteAheadLog();
+
+    bool start(const char *path, bool truncate);
+    uint64_t append(char op, const void *key, const void *value);
+    void waitDurable(uint64_t position);
+    void flush();
+
+    template <typename F>
+    static int64_t scan(const char *path, uint32_t keyBytes, uint32_t valueBytes, F apply, uint64_t &validBytes);
+
+private:
+    int fd = -1;
+    mutex logLock;
+    condition_variable pendingReady, durableReady;
+    vector<char> pending;
+    uint64_t appended = 0, durable = 0;  //Record bytes appended and made durable so far
+    uint64_t flushTo = 0;                //Set by flush, the commit thread syncs up to it without waiting out the interval
+    bool stopping = false;
+    thread committer;
+
+    void commit();
+};
+
+static const char LogMagic[8] = {'J', 'P', 'M', 'A', 'W', 'A', 'L', '1'};
+
+/*
+    Calls apply(op, key, value) for every complete record of the log at path, value is NULL for removes.
+    Stops at the first torn or unknown record. validBytes is set to the length of the file up to there.
+    Returns the number of records, or -1 if the file cannot be read or was written for other key or value sizes
+ */
+template <typename F>
+int64_t WriteAheadLog::scan(const char *path, uint32_t keyBytes, uint32_t valueBytes, F apply, uint64_t &validBytes){
+    validBytes = 0;
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) return -1;
+    header h;
+    if(fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, LogMagic, sizeof(LogMagic)) != 0
+       || h.keyBytes != keyBytes || h.valueBytes != valueBytes){
+        fclose(file);
+        return -1;
+    }
+    validBytes = sizeof(h);
+    vector<char> record(1 + keyBytes + valueBytes);
+    int64_t count = 0;
+    while(fread(&record[0], 1, 1, file) == 1){
+        char op = record[0];
+        if(op != RecordInsert && op != RecordRemove && op != RecordUpsert) break;
+        size_t rest = keyBytes + (op == RecordRemove ? 0 : valueBytes);
+        if(fread(&record[1], 1, rest, file) != rest) break;
+        apply(op, &record[1], op == RecordRemove ? NULL : &record[1 + keyBytes]);
+        validBytes += 1 + rest;
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+#endif
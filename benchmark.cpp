@@ -2,10 +2,16 @@
 #include <random>
 #include <chrono>
 #include <cstring>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 #include<fstream>
 
 #include "JPMA_BT.hpp"
+#include "ShardedPMA.hpp"
+#include "AsyncPMA.hpp"
 #include <time.h>
 
 #define InsertSize 10737418
@@ -16,49 +22,369 @@ void printArguments(){
     cout<<"USAGE: ./benchmark [options]"<<endl;
     cout<<"Options:"<<endl;
     cout<<"    -i [int]     number of key-value pairs to insert"<<endl;
-    cout<<"    -d [int]     number of key-value pairs to delete"<<endl;
+    cout<<"    -d [int]     number of random keys to delete and reinsert after the other phases (delete churn)"<<endl;
     cout<<"    -r [int]     length of range for sacnning "<<endl;
     cout<<"    -s [int]     number of key-value pairs to search"<<endl;
+    cout<<"    -u [int]     number of values to increment in place with update"<<endl;
+    cout<<"    -b           insert each generated batch with insert_batch"<<endl;
+    cout<<"    -l           bulk-load all keys with bulk_load instead of inserting them"<<endl;
+    cout<<"    -t [int]     run the mixed concurrent workload with 1, 2, 4, .. up to this many threads"<<endl;
+    cout<<"    -k [int]     run the mixed workload on a ShardedPMA with this many shards"<<endl;
+    cout<<"    -a [int]     run the mixed workload through AsyncPMA from this many client threads"<<endl;
+    cout<<"    -f [file]    save a loaded PMA to this snapshot file and time reopening it"<<endl;
+    cout<<"    -j [file]    time inserts with a write-ahead log at this path off, async and sync (threads from -t, default 4)"<<endl;
+    cout<<"    -n [int]     NUMA placement of segments, 0 first touch (default), 1 interleave, 2 key ranges per node"<<endl;
+    cout<<"    -m [int]     segment allocators, 1 hugetlb/THP/jemalloc, 2 jemalloc, 4 THP/jemalloc, 5 std::pmr (default Allocation_type)"<<endl;
+    cout<<"    -p [int]     number of threads for the range scan (range_sum_parallel)"<<endl;
+    cout<<"    -w [int]     key and value width in bits, 64 (default) or 32"<<endl;
+    cout<<"    -g           compare the built-in segment/fanout geometries on insert, search and scan"<<endl;
     cout<<endl;
 }
 
-int main(int argc, char **argv){
-    //Redirect cout to file out.txt
-    std::ofstream out("out.txt");
-    //std::streambuf *coutbuf = std::cout.rdbuf(); //save old buf
-    std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
-    
-    if (argc == 1) {
-        printArguments();
-        return 1;
+/*
+    Mixed workload on a concurrent PMA: 50% lookup, 40% insert, 5% remove and 5% range_sum.
+    The PMA is bulk-loaded with the odd keys up to 2*preload, inserts and removes pick random keys
+    from the same space. Runs again for each thread count and reports the throughput
+ */
+void concurrentBenchmark(type_t preload, int maxThreads, type_t opsPerThread, type_t rangeLength){
+    int64_t *data = (int64_t *)malloc(preload * sizeof(int64_t));
+    int64_t *values = (int64_t *)malloc(preload * sizeof(int64_t));
+    for(type_t i = 0; i< preload; i++){
+        data[i] = 2*i+1;
+        values[i] = data[i] * 10;
     }
+    for(int threads = 1; threads <= maxThreads; threads *= 2){
+        PMA<> pma(data, values, preload);
+        pma.enableConcurrency((preload + threads * opsPerThread) / 32 + 1024);
 
-    type_t totalInsert = 0;
-    type_t totalDelete = 0;
-    type_t rangeLength = 0;
-    type_t totalSearch = 0;
+        vector<thread> workers;
+        chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+        start = chrono::high_resolution_clock::now();
+        for(int t = 0; t<threads; t++){
+            workers.push_back(thread([&pma, t, preload, opsPerThread, rangeLength](){
+                std::mt19937 rng(t + 1);
+                std::uniform_int_distribution<int64_t> keys(1, 2*preload);
+                std::uniform_int_distribution<int> mix(0, 99);
+                for(type_t i = 0; i<opsPerThread; i++){
+                    int64_t key = keys(rng);
+                    int op = mix(rng);
+                    if(op < 50) pma.lookup(key);
+                    else if(op < 90) pma.insert(key, key * 10);
+                    else if(op < 95) pma.remove(key);
+                    else{
+                        type_t sum_key, sum_value;
+                        tie(sum_key, sum_value) = pma.range_sum(key, key + rangeLength);
+                        if(sum_key*10 != sum_value){
+                            cout<<"Error in concurrent range scan!"<<endl;
+                            exit(0);
+                        }
+                    }
+                }
+            }));
+        }
+        for(int t = 0; t<threads; t++) workers[t].join();
+        stop = chrono::high_resolution_clock::now();
+        int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        pma.disableConcurrency();
+        cout<<"Threads: "<<threads<<" operations: "<<threads * opsPerThread<<" in "<<delay<<" microSeconds ("
+            <<(delay > 0 ? (double)(threads * opsPerThread) / delay : 0)<<" Mops/s)"<<endl;
+    }
+    free(data);
+    free(values);
+}
 
-    for (type_t i = 1; i<argc; i++) {
-        if(strcmp(argv[i], "-i") == 0) {
-            totalInsert = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-d") == 0) {
-            totalDelete = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-r") == 0) {
-            rangeLength = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-s") == 0) {
-            totalSearch = atoi(argv[++i]);
-        } else {
-            printArguments();
-            return 1;
+/*
+    Same mix as concurrentBenchmark, submitted from one thread to a ShardedPMA.
+    Keys are loaded in random order so the initial split points see an even load
+ */
+void shardedBenchmark(type_t preload, int shardCount, type_t totalOps, type_t rangeLength){
+    ShardedPMA sharded(shardCount, 1, 2*preload);
+    std::mt19937 rng(1);
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    start = chrono::high_resolution_clock::now();
+    for(type_t i = 0; i< preload; i++){
+        int64_t key = 2*(rng() % preload)+1;
+        sharded.insert(key, key * 10);
+    }
+    sharded.flush();
+    stop = chrono::high_resolution_clock::now();
+    cout<<"Shards: "<<shardCount<<" loaded "<<preload<<" keys in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds"<<endl;
+
+    std::uniform_int_distribution<int64_t> keys(1, 2*preload);
+    std::uniform_int_distribution<int> mix(0, 99);
+    start = chrono::high_resolution_clock::now();
+    for(type_t i = 0; i<totalOps; i++){
+        int64_t key = keys(rng);
+        int op = mix(rng);
+        if(op < 50) sharded.lookup(key);
+        else if(op < 90) sharded.insert(key, key * 10);
+        else if(op < 95) sharded.remove(key);
+        else{
+            type_t sum_key, sum_value;
+            tie(sum_key, sum_value) = sharded.range_sum(key, key + rangeLength);
+            if(sum_key*10 != sum_value){
+                cout<<"Error in sharded range scan!"<<endl;
+                exit(0);
+            }
         }
     }
+    sharded.flush();
+    stop = chrono::high_resolution_clock::now();
+    int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    cout<<"Shards: "<<sharded.shards.size()<<" (splits "<<sharded.shardSplits<<") operations: "<<totalOps<<" in "<<delay<<" microSeconds ("
+        <<(delay > 0 ? (double)totalOps / delay : 0)<<" Mops/s)"<<endl;
+}
 
-    PMA pma;
+/*
+    Same mix again, submitted through an AsyncPMA by clients threads. Each client keeps up to
+    AsyncWindow operations in flight before it waits for their futures
+ */
+void asyncBenchmark(type_t preload, int clients, type_t totalOps, type_t rangeLength){
+    const int AsyncWindow = 64;
+    int64_t *data = (int64_t *)malloc(preload * sizeof(int64_t));
+    int64_t *values = (int64_t *)malloc(preload * sizeof(int64_t));
+    for(type_t i = 0; i< preload; i++){
+        data[i] = 2*i+1;
+        values[i] = data[i] * 10;
+    }
+    PMA<> pma(data, values, preload);
+    free(data);
+    free(values);
 
-    if(totalInsert == 0){
-        totalInsert = InsertSize;
+    type_t opsPerClient = totalOps / clients;
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    type_t batches, descents;
+    start = chrono::high_resolution_clock::now();
+    {
+        AsyncPMA async(&pma);
+        vector<thread> workers;
+        for(int t = 0; t<clients; t++){
+            workers.push_back(thread([&async, t, preload, opsPerClient, rangeLength](){
+                std::mt19937 rng(t + 1);
+                std::uniform_int_distribution<int64_t> keys(1, 2*preload);
+                std::uniform_int_distribution<int> mix(0, 99);
+                vector<future<optional<type_t>>> gets;
+                vector<future<bool>> writes;
+                vector<future<tuple<type_t, type_t>>> scans;
+                for(type_t i = 0; i<opsPerClient; i++){
+                    int64_t key = keys(rng);
+                    int op = mix(rng);
+                    if(op < 50) gets.push_back(async.submit_get(key));
+                    else if(op < 90) writes.push_back(async.submit_put(key, key * 10));
+                    else if(op < 95) writes.push_back(async.submit_remove(key));
+                    else scans.push_back(async.submit_range_sum(key, key + rangeLength));
+                    if((i + 1) % AsyncWindow == 0 || i + 1 == opsPerClient){
+                        for(u_int g = 0; g<gets.size(); g++){
+                            optional<type_t> value = gets[g].get();
+                            if(value && *value % 10 != 0){
+                                cout<<"Error in async lookup!"<<endl;
+                                exit(0);
+                            }
+                        }
+                        for(u_int w = 0; w<writes.size(); w++) writes[w].get();
+                        for(u_int s = 0; s<scans.size(); s++){
+                            type_t sum_key, sum_value;
+                            tie(sum_key, sum_value) = scans[s].get();
+                            if(sum_key*10 != sum_value){
+                                cout<<"Error in async range scan!"<<endl;
+                                exit(0);
+                            }
+                        }
+                        gets.clear();
+                        writes.clear();
+                        scans.clear();
+                    }
+                }
+            }));
+        }
+        for(int t = 0; t<clients; t++) workers[t].join();
+        batches = async.batches;
+        descents = async.descents;
+    }
+    stop = chrono::high_resolution_clock::now();
+    int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    cout<<"Clients: "<<clients<<" operations: "<<clients * opsPerClient<<" in "<<batches<<" batches ("<<descents<<" write descents), "<<delay<<" microSeconds ("
+        <<(delay > 0 ? (double)(clients * opsPerClient) / delay : 0)<<" Mops/s)"<<endl;
+}
+
+/*
+    Loads preload keys in random order, saves the PMA to path and opens it again. Reports the load, save
+    and open times and a full scan of the reopened PMA, which pulls its pages in from the file
+ */
+void snapshotBenchmark(type_t preload, const char *path){
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    type_t sum_key, sum_value, open_key, open_value;
+    {
+        PMA<> pma;
+        std::mt19937 rng(1);
+        start = chrono::high_resolution_clock::now();
+        for(type_t i = 0; i< preload; i++){
+            int64_t key = rng() % (4*preload) + 1;
+            pma.insert(key, key * 10);
+        }
+        stop = chrono::high_resolution_clock::now();
+        cout<<"Inserted "<<preload<<" keys in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+        tie(sum_key, sum_value) = pma.range_sum(0, 4*preload + 1);
+
+        start = chrono::high_resolution_clock::now();
+        if(!pma.save(path)) exit(0);
+        stop = chrono::high_resolution_clock::now();
+        cout<<"Saved snapshot in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+    }
+
+    PMA<> pma;
+    start = chrono::high_resolution_clock::now();
+    if(!pma.open(path)) exit(0);
+    stop = chrono::high_resolution_clock::now();
+    cout<<"Opened snapshot in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+    start = chrono::high_resolution_clock::now();
+    tie(open_key, open_value) = pma.range_sum(0, 4*preload + 1);
+    stop = chrono::high_resolution_clock::now();
+    if(open_key != sum_key || open_value != sum_value){
+        cout<<"Error in reopened snapshot!"<<endl;
+        exit(0);
+    }
+    cout<<"Scanned the reopened PMA in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+}
+
+/*
+    Inserts from several threads into a concurrent PMA without a log, with an async log and with a sync log
+    where every insert waits for its group commit. The sync log is then replayed into an empty PMA
+ */
+void walBenchmark(type_t totalOps, const char *path, int threads){
+    const char *modes[] = {"off", "async", "sync"};
+    type_t opsPerThread = totalOps / threads;
+    tuple<type_t, type_t> logged;
+    for(int mode = 0; mode <= WriteAheadLog::LogSync; mode++){
+        PMA<> pma;
+        pma.enableConcurrency(totalOps / 32 + 1024);
+        if(mode > 0 && !pma.enable_log(path, mode, true)) exit(0);
+
+        vector<thread> workers;
+        chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+        start = chrono::high_resolution_clock::now();
+        for(int t = 0; t<threads; t++){
+            workers.push_back(thread([&pma, t, totalOps, opsPerThread](){
+                std::mt19937 rng(t + 1);
+                std::uniform_int_distribution<int64_t> keys(1, 4*totalOps);
+                for(type_t i = 0; i<opsPerThread; i++){
+                    int64_t key = keys(rng);
+                    pma.insert(key, key * 10);
+                }
+            }));
+        }
+        for(int t = 0; t<threads; t++) workers[t].join();
+        uint64_t syncs = pma.wal != NULL ? pma.wal->syncs : 0;
+        pma.disable_log();
+        stop = chrono::high_resolution_clock::now();
+        int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        pma.disableConcurrency();
+        cout<<"Log "<<modes[mode]<<": "<<threads * opsPerThread<<" inserts from "<<threads<<" threads in "<<delay<<" microSeconds ("
+            <<(delay > 0 ? (double)(threads * opsPerThread) / delay : 0)<<" Mops/s), "<<syncs<<" syncs"<<endl;
+        logged = pma.range_sum(0, 4*totalOps + 1);
     }
 
+    PMA<> recovered;
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    start = chrono::high_resolution_clock::now();
+    int64_t records = recovered.replay_log(path);
+    stop = chrono::high_resolution_clock::now();
+    if(records < 0 || recovered.range_sum(0, 4*totalOps + 1) != logged){
+        cout<<"Error in log recovery!"<<endl;
+        exit(0);
+    }
+    cout<<"Replayed "<<records<<" records in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+}
+
+/*
+    Times the insert, search and scan workloads on one geometry. Keys 1..totalInsert are inserted in
+    random order, then totalSearch random lookups and 100 range_sums of rangeLength follow.
+    The same seeds are used for every geometry
+ */
+template <typename Config>
+vector<int64_t> geometryRun(type_t totalInsert, type_t totalSearch, type_t rangeLength, string &name){
+    name = to_string(Config::segmentSize) + "B segments, fanout " + to_string(Config::treeDegree) + "/" + to_string(Config::leafDegree)
+         + ", gap " + to_string(Config::maxGap);
+    PMA<int64_t, int64_t, Config> pma;
+    vector<int64_t> keys(totalInsert);
+    for(type_t i = 0; i<totalInsert; i++) keys[i] = i + 1;
+    std::mt19937 rng(1);
+    shuffle(keys.begin(), keys.end(), rng);
+
+    vector<int64_t> delays;
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    start = chrono::high_resolution_clock::now();
+    for(type_t i = 0; i<totalInsert; i++) pma.insert(keys[i], keys[i] * 10);
+    stop = chrono::high_resolution_clock::now();
+    delays.push_back(chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+
+    std::uniform_int_distribution<int64_t> numbers(1, totalInsert);
+    for(type_t i = 0; i<totalSearch; i++) keys[i % totalInsert] = numbers(rng);
+    start = chrono::high_resolution_clock::now();
+    for(type_t i = 0; i<totalSearch; i++){
+        if(!pma.lookup(keys[i % totalInsert])){
+            cout<<"Could not get key: "<<keys[i % totalInsert]<<endl;
+            exit(0);
+        }
+    }
+    stop = chrono::high_resolution_clock::now();
+    delays.push_back(chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+
+    std::uniform_int_distribution<int64_t> starts(1, max((type_t)1, totalInsert - rangeLength));
+    type_t sum_key, sum_value;
+    start = chrono::high_resolution_clock::now();
+    for(int i = 0; i<100; i++){
+        int64_t from = starts(rng);
+        tie(sum_key, sum_value) = pma.range_sum(from, from + rangeLength);
+        if(sum_key*10 != sum_value){
+            cout<<"Error in range scan!"<<endl;
+            exit(0);
+        }
+    }
+    stop = chrono::high_resolution_clock::now();
+    delays.push_back(chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+    return delays;
+}
+
+/*
+    Runs the workloads on each geometry built into the library and reports the fastest one per workload
+ */
+void geometrySweep(type_t totalInsert, type_t totalSearch, type_t rangeLength){
+    const char *workloads[] = {"insert", "search", "scan"};
+    vector<string> names(7);
+    vector<vector<int64_t>> delays;
+    delays.push_back(geometryRun<PMAConfig<>>(totalInsert, totalSearch, rangeLength, names[0]));
+    delays.push_back(geometryRun<PMAConfig<512>>(totalInsert, totalSearch, rangeLength, names[1]));
+    delays.push_back(geometryRun<PMAConfig<2048>>(totalInsert, totalSearch, rangeLength, names[2]));
+    delays.push_back(geometryRun<PMAConfig<4096>>(totalInsert, totalSearch, rangeLength, names[3]));
+    delays.push_back(geometryRun<PMAConfig<1024, 4, 5>>(totalInsert, totalSearch, rangeLength, names[4]));
+    delays.push_back(geometryRun<PMAConfig<1024, 9, 9>>(totalInsert, totalSearch, rangeLength, names[5]));
+    delays.push_back(geometryRun<PMAConfig<1024, Tree_Degree, Leaf_Degree, 1>>(totalInsert, totalSearch, rangeLength, names[6]));
+
+    for(size_t g = 0; g<names.size(); g++){
+        cout<<names[g]<<": insert "<<delays[g][0]<<" search "<<delays[g][1]<<" scan "<<delays[g][2]<<" microSeconds"<<endl;
+    }
+    for(int w = 0; w<3; w++){
+        size_t best = 0;
+        for(size_t g = 1; g<names.size(); g++){
+            if(delays[g][w] < delays[best][w]) best = g;
+        }
+        cout<<"Fastest "<<workloads[w]<<": "<<names[best]<<" ("<<delays[best][w]<<" microSeconds)"<<endl;
+    }
+}
+
+/*
+    Insert, search, scan and update timings on a PMA with Key keys and values
+ */
+template <typename Key>
+int standardBenchmark(type_t totalInsert, type_t totalDelete, type_t rangeLength, type_t totalSearch, type_t totalUpdate,
+                      bool batchInsert, bool bulkLoad, int scanThreads, int numaPolicy, int allocatorChain){
+    PMA<Key, Key> pma;
+    pma.numa_placement(numaPolicy, 1, totalInsert);
+    PmrAllocator pmrAllocator(pmr::new_delete_resource());
+    if(allocatorChain == 5) pma.set_allocators({&pmrAllocator});
+    else if(allocatorChain != 0) pma.set_allocators(SegmentAllocator::chain(allocatorChain));
+
     if(totalInsert < rangeLength) {
         cout<<"Range length greater than total elements"<<endl;
         exit(1);
@@ -72,9 +398,24 @@ int main(int argc, char **argv){
     int insertCount = 128, inserted = 0;
     int64_t insertDelay = 0;
     chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    if(bulkLoad){
+        Key *data = (Key *)malloc(totalInsert * sizeof(Key));
+        Key *values = (Key *)malloc(totalInsert * sizeof(Key));
+        for(type_t i = 0; i< totalInsert; i++){
+            data[i] = i+1;
+            values[i] = data[i] * 10;
+        }
+        start = chrono::high_resolution_clock::now();
+        pma.bulk_load(data, values, totalInsert);
+        stop = chrono::high_resolution_clock::now();
+        insertDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        inserted = totalInsert;
+        free(data);
+        free(values);
+    }
     while(inserted+insertCount <= totalInsert){
-        int64_t *data;
-        data =  (int64_t *)malloc(insertCount * sizeof(int64_t));
+        Key *data;
+        data =  (Key *)malloc(insertCount * sizeof(Key));
         srand (time(NULL));
         for(int i = 0; i< insertCount; i++){
             data[i] = i+inserted+1;
@@ -82,7 +423,8 @@ int main(int argc, char **argv){
         }
 
         for(int i = 0; i<insertCount; i++){
-            int64_t source, dest, buffer;
+            int64_t source, dest;
+            Key buffer;
             source = rand() % insertCount;
             dest = rand() % insertCount;
             buffer = data[source];
@@ -90,9 +432,21 @@ int main(int argc, char **argv){
             data[dest] = buffer;
         }
 
+        Key *values = NULL;
+        if(batchInsert){
+            values = (Key *)malloc(insertCount * sizeof(Key));
+            for(int i = 0; i<insertCount; i++){
+                values[i] = data[i] * 10;
+            }
+        }
+
         start = chrono::high_resolution_clock::now();
-        for(int i = 0; i<insertCount; i++){
-            pma.insert(data[i], data[i] * 10);
+        if(batchInsert){
+            pma.insert_batch(data, values, insertCount);
+        }else{
+            for(int i = 0; i<insertCount; i++){
+                pma.insert(data[i], data[i] * 10);
+            }
         }
         stop = chrono::high_resolution_clock::now();
         int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
@@ -103,12 +457,26 @@ int main(int argc, char **argv){
             insertCount *= 2;
         }
         insertDelay += delay;
+        free(data);
+        if(values != NULL) free(values);
     }
     cout << "Time taken for insert: " << insertDelay << endl;
     pma.printStat();
+    if(allocatorChain != 0){
+        //Which allocator of the chain served the chunks, later ones only after the earlier ones failed
+        vector<tuple<string, int>> served;
+        for(u_int c = 0; c<pma.chunks.size(); c++){
+            string name = pma.chunks[c].source != NULL ? pma.chunks[c].source->name() : "none";
+            u_int s = 0;
+            while(s < served.size() && get<0>(served[s]) != name) s++;
+            if(s == served.size()) served.push_back({name, 0});
+            get<1>(served[s])++;
+        }
+        for(u_int s = 0; s<served.size(); s++) cout<<"Chunks from "<<get<0>(served[s])<<": "<<get<1>(served[s])<<endl;
+    }
 
     //Searching in the PMA
-    type_t records[totalSearch+1];
+    Key records[totalSearch+1];
     std::random_device dev;
     std::mt19937 rng(dev());
     std::uniform_int_distribution<std::mt19937::result_type> numbers(1,totalSearch);
@@ -125,12 +493,28 @@ int main(int argc, char **argv){
     stop = chrono::high_resolution_clock::now();
     int64_t searchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
     cout<<"Searched "<<totalSearch<<" elements in "<<searchDelay<<" microSeconds."<<endl;
+
+    //Same probes through lookup_batch
+    Key *batchValues = (Key *)malloc(totalSearch * sizeof(Key));
+    bool *batchFound = (bool *)malloc(totalSearch * sizeof(bool));
+    start = chrono::high_resolution_clock::now();
+    size_t batchHits = pma.lookup_batch(records, totalSearch, batchValues, batchFound);
+    stop = chrono::high_resolution_clock::now();
+    if(batchHits != (size_t)totalSearch){
+        cout<<"Batch lookup missed "<<totalSearch - batchHits<<" keys"<<endl;
+        exit(0);
+    }
+    int64_t batchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    cout<<"Batch searched "<<totalSearch<<" elements in "<<batchDelay<<" microSeconds."<<endl;
+    free(batchValues);
+    free(batchFound);
     
     //Range Scan in the PMA
     type_t startRange = rand()%(totalInsert - rangeLength);
     type_t sum_key, sum_value;
     start = chrono::high_resolution_clock::now();
-    tie(sum_key, sum_value) = pma.range_sum(startRange, startRange+rangeLength);
+    if(scanThreads > 0) tie(sum_key, sum_value) = pma.range_sum_parallel(startRange, startRange+rangeLength, scanThreads);
+    else tie(sum_key, sum_value) = pma.range_sum(startRange, startRange+rangeLength);
     stop = chrono::high_resolution_clock::now();
     if(sum_key*10 != sum_value){
         cout<<"Error in range scan!"<<endl;
@@ -138,5 +522,177 @@ int main(int argc, char **argv){
     }
     int64_t scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
     cout<<"Scanned elements with range "<<rangeLength<<" in " <<scanDelay<<" microSeconds."<<endl;
+    if(numaPolicy != pma.NumaFirstTouch) cout<<"Segments scanned on the local node: "<<pma.localAccesses<<", remote: "<<pma.remoteAccesses<<endl;
+
+    //Read-modify-write in the PMA
+    if(totalUpdate > 0){
+        std::uniform_int_distribution<std::mt19937::result_type> keys(1,inserted);
+        start = chrono::high_resolution_clock::now();
+        for(type_t i=0; i<totalUpdate; i++){
+            Key key = keys(rng);
+            if(!pma.update(key, [](Key value){ return value + 1; })){
+                cout<<"Could not update key: "<<key<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        int64_t updateDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Updated "<<totalUpdate<<" elements in "<<updateDelay<<" microSeconds."<<endl;
+    }
+
+    //Delete churn: removes totalDelete random keys and inserts them again, with a full scan before and after the removes
+    if(totalDelete > 0){
+        vector<Key> victims;
+        for(int i = 1; i<=inserted; i++) victims.push_back(i);
+        shuffle(victims.begin(), victims.end(), rng);
+        victims.resize(min((type_t)inserted, totalDelete));
+
+        start = chrono::high_resolution_clock::now();
+        pma.range_sum(1, inserted);
+        stop = chrono::high_resolution_clock::now();
+        int64_t fullScanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        int segmentsBefore = pma.totalSegments, mergesBefore = pma.redisRemCount;
+
+        start = chrono::high_resolution_clock::now();
+        for(u_int i = 0; i<victims.size(); i++){
+            if(!pma.remove(victims[i])){
+                cout<<"Could not delete key: "<<victims[i]<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        int64_t deleteDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Deleted "<<victims.size()<<" elements in "<<deleteDelay<<" microSeconds, segments "<<segmentsBefore<<" -> "<<pma.totalSegments
+            <<", redistributions with remove: "<<pma.redisRemCount - mergesBefore<<endl;
+
+        start = chrono::high_resolution_clock::now();
+        pma.range_sum(1, inserted);
+        stop = chrono::high_resolution_clock::now();
+        cout<<"Full scan in "<<fullScanDelay<<" microSeconds before the deletes, "
+            <<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" after."<<endl;
+
+        start = chrono::high_resolution_clock::now();
+        for(u_int i = 0; i<victims.size(); i++) pma.insert(victims[i], victims[i] * 10);
+        stop = chrono::high_resolution_clock::now();
+        cout<<"Reinserted "<<victims.size()<<" elements in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()
+            <<" microSeconds, segments "<<pma.totalSegments<<endl;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv){
+    //Redirect cout to file out.txt
+    std::ofstream out("out.txt");
+    std::streambuf *coutbuf = std::cout.rdbuf(); //save old buf
+    std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
+    
+    if (argc == 1) {
+        printArguments();
+        return 1;
+    }
+
+    type_t totalInsert = 0;
+    type_t totalDelete = 0;
+    type_t rangeLength = 0;
+    type_t totalSearch = 0;
+    type_t totalUpdate = 0;
+    bool batchInsert = false;
+    bool bulkLoad = false;
+    int maxThreads = 0;
+    int shardCount = 0;
+    int asyncClients = 0;
+    const char *snapshotPath = NULL;
+    const char *logPath = NULL;
+    int scanThreads = 0;
+    int numaPolicy = 0;
+    int allocatorChain = 0;
+    int keyWidth = 64;
+    bool geometries = false;
+
+    for (type_t i = 1; i<argc; i++) {
+        if(strcmp(argv[i], "-i") == 0) {
+            totalInsert = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            totalDelete = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            rangeLength = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            totalSearch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            totalUpdate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batchInsert = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            bulkLoad = true;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            maxThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            shardCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            asyncClients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            snapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            logPath = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            numaPolicy = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            allocatorChain = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            scanThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            keyWidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0) {
+            geometries = true;
+        } else {
+            printArguments();
+            return 1;
+        }
+    }
+
+    if(totalInsert == 0){
+        totalInsert = InsertSize;
+    }
+
+    if(logPath != NULL){
+        walBenchmark(totalInsert, logPath, maxThreads > 0 ? maxThreads : 4);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    if(maxThreads > 0){
+        concurrentBenchmark(totalInsert, maxThreads, totalSearch > 0 ? totalSearch : 1000000, rangeLength > 0 ? rangeLength : 100);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    if(shardCount > 0){
+        shardedBenchmark(totalInsert, shardCount, totalSearch > 0 ? totalSearch : 1000000, rangeLength > 0 ? rangeLength : 100);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    if(asyncClients > 0){
+        asyncBenchmark(totalInsert, asyncClients, totalSearch > 0 ? totalSearch : 1000000, rangeLength > 0 ? rangeLength : 100);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    if(snapshotPath != NULL){
+        snapshotBenchmark(totalInsert, snapshotPath);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    if(geometries){
+        geometrySweep(totalInsert, totalSearch > 0 ? totalSearch : 1000000, rangeLength > 0 ? rangeLength : 1000);
+        std::cout.rdbuf(coutbuf);
+        return 0;
+    }
+
+    int result;
+    if(keyWidth == 32) result = standardBenchmark<int32_t>(totalInsert, totalDelete, rangeLength, totalSearch, totalUpdate, batchInsert, bulkLoad, scanThreads, numaPolicy, allocatorChain);
+    else result = standardBenchmark<int64_t>(totalInsert, totalDelete, rangeLength, totalSearch, totalUpdate, batchInsert, bulkLoad, scanThreads, numaPolicy, allocatorChain);
+    std::cout.rdbuf(coutbuf); //out.txt is closed before the exit-time flush of cout
+    return result;
+}
@@ -6,6 +6,7 @@
 //#define CHUNK_SIZE 262144
 //#define SEGMENT_SIZE 16384//1024//16384//32768
 
+//Default geometry. SEGMENT_SIZE, CHUNK_SIZE, Tree_Degree, Leaf_Degree and MaxGap are the defaults of PMAConfig
 #define SEGMENT_SIZE 1024
 //#define TOTAL_SEGMENTS 65536
 
@@ -16,30 +17,89 @@
 
 #define PROTECTION (PROT_READ | PROT_WRITE)
 
-#ifndef MAP_HUGETLB
-#define MAP_HUGETLB 0x40000 /* arch specific */
-#endif
-
-//1 for mmap, 2 for malloc
+//Default SegmentAllocator chain. 1 for hugetlb, falling back to transparent huge pages and then jemalloc,
+//2 for a jemalloc arena, 3 for a sparse file in SegmentFileDir mapped MAP_SHARED, 4 for transparent
+//huge pages falling back to jemalloc
 #ifndef Allocation_type
 #define Allocation_type 2
 #endif
+//Huge page size the hugetlb and transparent huge page allocators align chunks to
+#ifndef HugePageBytes
+#define HugePageBytes 2097152UL
+#endif
+//Allocation_type 3. Every PMA keeps its chunks in an unlinked file in this directory, so segments can
+//be written back and dropped by the page cache. Scans ask for the segments ScanAdviseAhead leaves ahead
+//to be read in, and mark the chunks sequential once they have passed ScanSequentialLeaves leaves
+#ifndef SegmentFileDir
+#define SegmentFileDir "/var/tmp"
+#endif
+#define ScanAdviseAhead 4
+#define ScanSequentialLeaves 64
 
-#define Tree_Degree 4
-#define Leaf_Degree 5
-#define MaxLevel 65
+//range_sum block kernel. 0 for runtime dispatch, 1 for scalar, 2 for avx2, 3 for avx512
+#ifndef Scan_kernel
+#define Scan_kernel 0
+#endif
 
-#ifdef __ia64__
-#define ADDR (void *)(0x8000000000000000UL)
-#define FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED)
-#else
-#define ADDR (void *)(0x0UL)
-//#define FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB)
-#define FLAGS (MAP_SHARED |MAP_ANONYMOUS | MAP_HUGETLB)
+//findLocation strategy. 1 for gapped binary search, 2 for block search with a vector compare
+#ifndef Search_mode
+#define Search_mode 2
 #endif
+#define SearchGroupSize 16
+//Tree nodes with at least this many separators are searched with the vector compare kernel
+#ifndef NodeSearchMin
+#define NodeSearchMin 8
+#endif
+
+//Keys PMA::lookup_batch walks down together, prefetching each step for the whole group
+#ifndef LookupBatchGroup
+#define LookupBatchGroup 16
+#endif
+
+//ShardedPMA. Requests in flight per shard, submissions between balance checks, and a shard is split
+//once it holds more than ShardSplitFactor times the average (and at least ShardMinSplit elements)
+#define ShardQueueSize 4096
+#define ShardCheckInterval 4096
+#define ShardSplitFactor 2
+#define ShardMinSplit 65536
+#define ShardMaxCount 256
+
+//Write-ahead log. In async mode the commit thread syncs every LogSyncInterval milliseconds, or earlier
+//once LogFlushBytes are pending. In sync mode it syncs as soon as records are pending
+#ifndef LogSyncInterval
+#define LogSyncInterval 10
+#endif
+#ifndef LogFlushBytes
+#define LogFlushBytes (1 << 20)
+#endif
+
+//Largest number of NUMA nodes PMA::numa_placement keeps free segment pools for
+#define NumaMaxNodes 64
+
+//Upper-level redistribution. A window is rebuilt on one thread per ParallelRedistributeMin segments,
+//up to RedistributeThreads threads (0 for one per core). A share is about a millisecond of copying,
+//well above the cost of starting and joining its thread
+#ifndef RedistributeThreads
+#define RedistributeThreads 0
+#endif
+#ifndef ParallelRedistributeMin
+#define ParallelRedistributeMin 512
+#endif
+
+//Chunks are given back to the OS once more than half of the allocated segments are free and at least
+//two chunks' worth of them are. 0 leaves it to explicit PMA::shrink_to_fit calls
+#ifndef AutoShrink
+#define AutoShrink 1
+#endif
+
+//Fanout of the tree nodes and leaves. 17 children take 16 separators, two cache lines of 64 bit keys
+#define Tree_Degree 17
+#define Leaf_Degree 17
+#define MaxLevel 65
 
-#define JacobsonIndexSize 16
-#define JacobsonIndexCount 65536
+//Segment occupancy is kept in 64-bit words, one bit per slot
+#define bitmap_t uint64_t
+#define JacobsonIndexSize 64
 //#define ProbLimit 32
 #define ProbLimit (SEGMENT_SIZE * 10)/800 //Sizeof(type_t) = 8
 #define MaxGap 3